@@ -63,6 +63,19 @@
  */
 #define MAX_HEAP (20*(1<<20))  /* 20 MB */
 
+/*
+ * How memlib gets the memory for the heap. 0 mallocs all of it up
+ * front, 1 only reserves the address space with mmap and commits
+ * pages as the brk advances, so the heap can be as large as the
+ * address space allows (build with -DMEM_RESERVE=1)
+ */
+#ifndef MEM_RESERVE
+#define MEM_RESERVE 0
+#endif
+
+/* Pages are committed in chunks of this many bytes */
+#define MEM_COMMIT_CHUNK (64*(1<<10))
+
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
  *****************************************************************************/
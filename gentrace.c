@@ -0,0 +1,426 @@
+/*
+ * gentrace.c - Generates a balanced trace from a workload spec.
+ *
+ * "gentrace spec trace [seed]" writes a trace whose sizes, lifetimes,
+ * reallocs and live set follow the spec, traces/example.spec describes
+ * the format. A spec and a seed always give the same trace, the random
+ * numbers don't come from the C library. Ids of freed blocks are reused,
+ * so a trace has no more ids than blocks live at once, and mdriver -s
+ * can replay traces of any length. mdriver -w turns them into binary
+ * traces.
+ */
+#define _GNU_SOURCE
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//Most size distributions a spec can mix
+#define MAX_SIZE_DISTS 16
+
+typedef enum DistKind {
+    DIST_FIXED,       //n
+    DIST_UNIFORM,     //lo hi
+    DIST_POW2,        //lo hi, powers of two between them, each as likely
+    DIST_LOGNORMAL,   //mu sigma of the log of the value
+    DIST_BIMODAL,     //a b p, a with probability p and b otherwise
+    DIST_EXPONENTIAL  //mean
+} DistKind;
+
+typedef struct Dist {
+    DistKind kind;
+    double a, b, c;
+    double weight; //Share of a size distribution in the mix
+} Dist;
+
+typedef struct Spec {
+    uint64_t seed;
+    long ops;             //Requests in the trace, the final frees included
+    int live;             //Most blocks live at once
+    int maxSize;          //Sizes and reallocs are clamped to 1..maxSize
+    Dist sizes[MAX_SIZE_DISTS];
+    int numSizes;
+    double totalWeight;
+    Dist lifetime;        //Requests a block stays live
+    double reallocProb;   //Chance a request reallocs a live block...
+    double growMin;       //...by a factor between these two
+    double growMax;
+    double callocProb;    //Chance an allocation is a calloc...
+    double memalignProb;  //...or a memalign to alignment
+    int alignment;
+} Spec;
+
+//The live blocks, in a min-heap by the request they are freed at
+typedef struct LiveSet {
+    int *heap;       //Ids, soonest death first
+    int numLive;
+    int *sizes;      //By id
+    long *deaths;
+    int *positions;  //Index of each live id in heap
+    int *freeIds;    //Stack of the ids of freed blocks
+    int numFreeIds;
+    int numIds;
+    int maxIds;
+} LiveSet;
+
+typedef struct TraceStats {
+    long ops;
+    long liveBytes;
+    long peakBytes;
+} TraceStats;
+
+static Spec spec;
+static LiveSet set;
+static TraceStats stats;
+static uint64_t rngState;
+static FILE *ops;
+
+/*
+ * Random numbers
+ */
+
+//splitmix64, small and the same everywhere
+static uint64_t nextRandom(void) {
+    uint64_t z = (rngState += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+//Uniform in [0, 1)
+static double nextUnit(void) {
+    return (nextRandom() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static long nextBelow(long n) {
+    return (long) (nextRandom() % (uint64_t) n);
+}
+
+//Box-Muller
+static double nextNormal(void) {
+    double u = 1.0 - nextUnit();
+    return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * nextUnit());
+}
+
+static double sample(const Dist *d) {
+    int lo, hi;
+
+    switch (d->kind) {
+        case DIST_FIXED:
+            return d->a;
+        case DIST_UNIFORM:
+            return d->a + nextBelow((long) (d->b - d->a) + 1);
+        case DIST_POW2:
+            for (lo = 0; (1L << lo) < d->a; lo++);
+            for (hi = lo; (1L << (hi + 1)) <= d->b; hi++);
+            //No power of two between lo and hi
+            if ((1L << lo) > d->b) return d->a;
+            return (double) (1L << (lo + nextBelow(hi - lo + 1)));
+        case DIST_LOGNORMAL:
+            return exp(d->a + d->b * nextNormal());
+        case DIST_BIMODAL:
+            return nextUnit() < d->c ? d->a : d->b;
+        case DIST_EXPONENTIAL:
+            return -d->a * log(1.0 - nextUnit());
+    }
+    return 1;
+}
+
+static int clampSize(double size) {
+    if (size < 1) return 1;
+    if (size > spec.maxSize) return spec.maxSize;
+    return (int) size;
+}
+
+static int nextSize(void) {
+    double pick = nextUnit() * spec.totalWeight;
+    int i;
+
+    for (i = 0; i < spec.numSizes - 1 && pick >= spec.sizes[i].weight; i++) pick -= spec.sizes[i].weight;
+    return clampSize(sample(&spec.sizes[i]));
+}
+
+/*
+ * Spec files
+ */
+
+static void specError(int line, const char *msg) {
+    fprintf(stderr, "spec line %d: %s\n", line, msg);
+    exit(1);
+}
+
+//Next number on the line being parsed
+static double number(int line) {
+    char *token = strtok(NULL, " \t\r\n");
+    char *end;
+    double value;
+
+    if (token == NULL) specError(line, "missing number");
+    value = strtod(token, &end);
+    if (*end != '\0') specError(line, "not a number");
+    return value;
+}
+
+static void parseDist(Dist *d, int line) {
+    char *kind = strtok(NULL, " \t\r\n");
+
+    if (kind == NULL) specError(line, "missing distribution");
+    d->a = d->b = d->c = 0;
+    d->weight = 1;
+    if (strcmp(kind, "fixed") == 0) {
+        d->kind = DIST_FIXED;
+        d->a = number(line);
+    } else if (strcmp(kind, "uniform") == 0 || strcmp(kind, "pow2") == 0) {
+        d->kind = kind[0] == 'u' ? DIST_UNIFORM : DIST_POW2;
+        d->a = number(line);
+        d->b = number(line);
+        if (d->a < 1 || d->b < d->a) specError(line, "need 1 <= lo <= hi");
+    } else if (strcmp(kind, "lognormal") == 0) {
+        d->kind = DIST_LOGNORMAL;
+        d->a = number(line);
+        d->b = number(line);
+    } else if (strcmp(kind, "bimodal") == 0) {
+        d->kind = DIST_BIMODAL;
+        d->a = number(line);
+        d->b = number(line);
+        d->c = number(line);
+    } else if (strcmp(kind, "exponential") == 0) {
+        d->kind = DIST_EXPONENTIAL;
+        d->a = number(line);
+    } else {
+        specError(line, "unknown distribution");
+    }
+
+    char *weight = strtok(NULL, " \t\r\n");
+    if (weight != NULL) {
+        if (strcmp(weight, "weight") != 0) specError(line, "expected weight");
+        if ((d->weight = number(line)) <= 0) specError(line, "weight must be positive");
+    }
+}
+
+static void readSpec(const char *path) {
+    FILE *in;
+    char buf[1024];
+    char *key, *comment;
+    int line = 0;
+
+    spec.seed = 1;
+    spec.ops = 100000;
+    spec.live = 1000;
+    spec.maxSize = 1 << 20;
+    spec.lifetime.kind = DIST_EXPONENTIAL;
+    spec.lifetime.a = -1; //Defaults to the live set below
+    spec.growMin = spec.growMax = 1;
+    spec.alignment = 64;
+
+    if ((in = fopen(path, "r")) == NULL) {
+        perror(path);
+        exit(1);
+    }
+    while (fgets(buf, sizeof(buf), in) != NULL) {
+        line++;
+        if ((comment = strchr(buf, '#')) != NULL) *comment = '\0';
+        if ((key = strtok(buf, " \t\r\n")) == NULL) continue;
+
+        if (strcmp(key, "seed") == 0) {
+            spec.seed = (uint64_t) number(line);
+        } else if (strcmp(key, "ops") == 0) {
+            spec.ops = (long) number(line);
+        } else if (strcmp(key, "live") == 0) {
+            spec.live = (int) number(line);
+        } else if (strcmp(key, "max_size") == 0) {
+            spec.maxSize = (int) number(line);
+        } else if (strcmp(key, "size") == 0) {
+            if (spec.numSizes == MAX_SIZE_DISTS) specError(line, "too many size distributions");
+            parseDist(&spec.sizes[spec.numSizes], line);
+            if (spec.sizes[spec.numSizes].kind == DIST_EXPONENTIAL) specError(line, "exponential is for lifetimes");
+            spec.totalWeight += spec.sizes[spec.numSizes++].weight;
+        } else if (strcmp(key, "lifetime") == 0) {
+            parseDist(&spec.lifetime, line);
+        } else if (strcmp(key, "realloc") == 0) {
+            spec.reallocProb = number(line);
+            spec.growMin = number(line);
+            char *max = strtok(NULL, " \t\r\n");
+            spec.growMax = max != NULL ? strtod(max, NULL) : spec.growMin;
+            if (spec.growMin <= 0 || spec.growMax < spec.growMin) specError(line, "need 0 < min <= max");
+        } else if (strcmp(key, "calloc") == 0) {
+            spec.callocProb = number(line);
+        } else if (strcmp(key, "memalign") == 0) {
+            spec.memalignProb = number(line);
+            spec.alignment = (int) number(line);
+            if (spec.alignment < 8 || (spec.alignment & (spec.alignment - 1)) != 0)
+                specError(line, "alignment must be a power of two of at least 8");
+        } else {
+            specError(line, "unknown key");
+        }
+    }
+    fclose(in);
+
+    if (spec.ops < 2 || spec.live < 1 || spec.maxSize < 1) specError(line, "ops, live and max_size must be positive");
+    if (spec.reallocProb < 0 || spec.reallocProb >= 1) specError(line, "realloc probability must be in [0, 1)");
+    if (spec.callocProb < 0 || spec.memalignProb < 0 || spec.callocProb + spec.memalignProb > 1)
+        specError(line, "calloc and memalign probabilities must add up to at most 1");
+    if (spec.numSizes == 0) {
+        spec.sizes[0] = (Dist) {DIST_UNIFORM, 1, 4096, 0, 1};
+        spec.numSizes = 1;
+        spec.totalWeight = 1;
+    }
+    //About every other request allocates, so this keeps around live blocks live
+    if (spec.lifetime.a < 0) spec.lifetime.a = 2.0 * spec.live;
+}
+
+/*
+ * The live set
+ */
+
+static int sooner(int x, int y) {
+    return set.deaths[x] < set.deaths[y] || (set.deaths[x] == set.deaths[y] && x < y);
+}
+
+static void place(int i, int id) {
+    set.heap[i] = id;
+    set.positions[id] = i;
+}
+
+static void siftUp(int i) {
+    int id = set.heap[i];
+    while (i > 0 && sooner(id, set.heap[(i - 1) / 2])) {
+        place(i, set.heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    place(i, id);
+}
+
+static void siftDown(int i) {
+    int id = set.heap[i];
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= set.numLive) break;
+        if (child + 1 < set.numLive && sooner(set.heap[child + 1], set.heap[child])) child++;
+        if (!sooner(set.heap[child], id)) break;
+        place(i, set.heap[child]);
+        i = child;
+    }
+    place(i, id);
+}
+
+static void *grow(void *array, size_t size) {
+    if ((array = realloc(array, set.maxIds * size)) == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    return array;
+}
+
+static int takeId(void) {
+    if (set.numFreeIds > 0) return set.freeIds[--set.numFreeIds];
+
+    if (set.numIds == set.maxIds) {
+        set.maxIds = set.maxIds ? 2 * set.maxIds : 1024;
+        set.heap = grow(set.heap, sizeof(int));
+        set.sizes = grow(set.sizes, sizeof(int));
+        set.deaths = grow(set.deaths, sizeof(long));
+        set.positions = grow(set.positions, sizeof(int));
+        set.freeIds = grow(set.freeIds, sizeof(int));
+    }
+    return set.numIds++;
+}
+
+static void allocBlock(void) {
+    int id = takeId();
+    int size = nextSize();
+    double kind = nextUnit();
+
+    if (kind < spec.callocProb) fprintf(ops, "c %d %d\n", id, size);
+    else if (kind < spec.callocProb + spec.memalignProb) fprintf(ops, "m %d %d %d\n", id, size, spec.alignment);
+    else fprintf(ops, "a %d %d\n", id, size);
+
+    set.sizes[id] = size;
+    set.deaths[id] = stats.ops + 1 + (long) fmin(sample(&spec.lifetime), (double) spec.ops);
+    place(set.numLive, id);
+    siftUp(set.numLive++);
+    stats.ops++;
+    stats.liveBytes += size;
+    if (stats.liveBytes > stats.peakBytes) stats.peakBytes = stats.liveBytes;
+}
+
+static void reallocBlock(void) {
+    int id = set.heap[nextBelow(set.numLive)];
+    double factor = spec.growMin + (spec.growMax - spec.growMin) * nextUnit();
+    int size = clampSize(set.sizes[id] * factor);
+
+    fprintf(ops, "r %d %d\n", id, size);
+    stats.ops++;
+    stats.liveBytes += size - set.sizes[id];
+    if (stats.liveBytes > stats.peakBytes) stats.peakBytes = stats.liveBytes;
+    set.sizes[id] = size;
+}
+
+//Frees the block that is due first
+static void freeBlock(void) {
+    int id = set.heap[0];
+
+    fprintf(ops, "f %d\n", id);
+    stats.ops++;
+    stats.liveBytes -= set.sizes[id];
+    set.freeIds[set.numFreeIds++] = id;
+    if (--set.numLive > 0) {
+        place(0, set.heap[set.numLive]);
+        siftDown(0);
+    }
+}
+
+/*
+ * Every request frees a block that is due, or else reallocs one, or else
+ * allocates one while fewer than live are live. With a full live set the
+ * block due first is freed early. Allocation stops in time to free every
+ * block within ops requests.
+ */
+int main(int argc, char **argv) {
+    FILE *out;
+    char chunk[1 << 16];
+    size_t n;
+
+    if (argc != 3 && argc != 4) {
+        fprintf(stderr, "Usage: gentrace <spec> <trace> [<seed>]\n");
+        return 1;
+    }
+    readSpec(argv[1]);
+    if (argc == 4) spec.seed = strtoull(argv[3], NULL, 0);
+    rngState = spec.seed;
+
+    //The header needs the counts, so the requests go to a temporary file first
+    if ((ops = tmpfile()) == NULL) {
+        perror("tmpfile");
+        return 1;
+    }
+    while (stats.ops + set.numLive < spec.ops) {
+        if (set.numLive > 0 && set.deaths[set.heap[0]] <= stats.ops) freeBlock();
+        else if (set.numLive > 0 && nextUnit() < spec.reallocProb) reallocBlock();
+        else if (set.numLive < spec.live && stats.ops + set.numLive + 2 <= spec.ops) allocBlock();
+        else if (set.numLive > 0) freeBlock();
+        else break;
+    }
+    while (set.numLive > 0) freeBlock();
+
+    if ((out = fopen(argv[2], "w")) == NULL) {
+        perror(argv[2]);
+        return 1;
+    }
+    fprintf(out, "%ld\n%d\n%ld\n1\n", stats.peakBytes, set.numIds, stats.ops);
+    rewind(ops);
+    while ((n = fread(chunk, 1, sizeof(chunk), ops)) > 0) {
+        if (fwrite(chunk, 1, n, out) != n) {
+            perror(argv[2]);
+            return 1;
+        }
+    }
+    if (fclose(out) != 0) {
+        perror(argv[2]);
+        return 1;
+    }
+
+    fprintf(stderr, "%s: %ld requests on %d ids, peak %ld bytes live\n", argv[2], stats.ops, set.numIds, stats.peakBytes);
+    return 0;
+}
@@ -16,6 +16,11 @@
 #include <assert.h>
 #include <float.h>
 #include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "mm.h"
 #include "memlib.h"
@@ -31,6 +36,13 @@
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
 
+/* Ops in each of the two buffers a streamed trace is read into */
+#define STREAM_CHUNK 65536
+
+/* Binary trace files start with this magic number and format version */
+#define TRACE_MAGIC   "MMTR"
+#define TRACE_VERSION 2
+
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p)  ((((uintptr_t)(p)) % ALIGNMENT) == 0)
 
@@ -38,33 +50,110 @@
  * The key compound data types 
  *****************************/
 
-/* Records the extent of each block's payload */
+/* Records the extent of each block's payload, kept in a splay tree ordered by lo */
 typedef struct range_t {
     char *lo;              /* low payload address */
     char *hi;              /* high payload address */
-    struct range_t *next;  /* next list element */
+    struct range_t *left;  /* ranges with a lower lo */
+    struct range_t *right; /* ranges with a higher lo */
 } range_t;
 
-/* Characterizes a single trace operation (allocator request) */
+/* The types of trace operations */
+enum {
+    ALLOC, FREE, REALLOC, ALLOC_BATCH, FREE_BATCH, MEMALIGN, CALLOC
+};
+
+/* 
+ * Characterizes a single trace operation (allocator request). Binary 
+ * trace files store the ops in exactly this 12-byte layout, so they 
+ * can be replayed straight from the mapped file. The type shares a 
+ * word with the argument of batches and memalign requests.
+ */
 typedef struct {
-    enum {
-        ALLOC, FREE, REALLOC
-    } type; /* type of request */
-    int index;                        /* index for free() to use later */
-    int size;                         /* byte size of alloc/realloc request */
+    uint32_t type : 8;                /* type of request */
+    uint32_t arg : 24;                /* batch count, or log2 of a memalign's alignment */
+    int32_t index;                    /* index for free() to use later */
+    int32_t size;                     /* byte size of alloc/realloc request */
 } traceop_t;
 
+/* Largest count a batch op can hold */
+#define MAX_BATCH ((1 << 24) - 1)
+
+/* Batches cover ids index..index+count-1 */
+#define OP_COUNT(op)     ((int) (op)->arg)
+
+/* Payload alignment of a memalign request */
+#define OP_ALIGNMENT(op) ((size_t) 1 << (op)->arg)
+
+/* Fails to compile if the op layout stops matching the binary format */
+typedef char traceop_size_check[sizeof(traceop_t) == 12 ? 1 : -1];
+
+/* 
+ * The header of a binary trace file, followed by num_ops traceop_t's. 
+ * Files are written in the byte order of the machine, one with the 
+ * other byte order fails the version check.
+ */
+typedef struct {
+    char magic[4];          /* TRACE_MAGIC */
+    uint32_t version;       /* TRACE_VERSION */
+    uint32_t op_bytes;      /* sizeof(traceop_t) */
+    int32_t sugg_heapsize;  /* same four fields as the text header */
+    int32_t num_ids;
+    int32_t num_ops;
+    int32_t weight;
+    uint32_t reserved;      /* zero */
+} trace_header_t;
+
 /* Holds the information for one trace file*/
 typedef struct {
     int sugg_heapsize;   /* suggested heap size (unused) */
     int num_ids;         /* number of alloc/realloc ids */
     int num_ops;         /* number of distinct requests */
     int weight;          /* weight for this trace (unused) */
-    traceop_t *ops;      /* array of requests */
+    traceop_t *ops;      /* array of requests, read-only if the file is mapped */
     char **blocks;       /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes; /* ... and a corresponding array of payload sizes */
+    void *map;           /* mapping of a binary trace file, or NULL */
+    size_t map_size;     /* its length in bytes */
 } trace_t;
 
+/* 
+ * A trace that is replayed as it is read instead of being loaded. A 
+ * reader thread fills the two buffers in turn while the replay works 
+ * through the other one.
+ */
+typedef struct {
+    FILE *file;              /* the trace file, positioned at the next op */
+    char path[MAXLINE];      /* its name, for error messages */
+    int binary;              /* ops are traceop_t records, not text lines */
+    traceop_t *bufs[2];      /* the two buffers... */
+    int counts[2];           /* ...the number of ops in each, 0 at the end */
+    int full[2];             /* set while a buffer waits for the replay */
+    int cur;                 /* buffer the replay reads next */
+    int held;                /* the replay is still using bufs[cur] */
+    int stop;                /* tells the reader to quit early */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t reader;
+} stream_t;
+
+/* A live block of a streamed trace */
+typedef struct {
+    int32_t id;              /* request id, -1 for an empty slot */
+    int32_t size;            /* payload size */
+    char *p;                 /* payload address */
+} live_t;
+
+/* 
+ * Open-addressing table of the live blocks of a streamed trace, keyed 
+ * by id. Its size follows the number of live blocks, not num_ids.
+ */
+typedef struct {
+    live_t *slots;           /* linear probing, no tombstones */
+    size_t mask;             /* number of slots - 1, a power of two */
+    size_t used;             /* slots holding a live block */
+} idtable_t;
+
 /* 
  * Holds the params to the xxx_speed functions, which are timed by fcyc. 
  * This struct is necessary because fcyc accepts only a pointer array
@@ -75,6 +164,16 @@ typedef struct {
     range_t *ranges;
 } speed_t;
 
+/* 
+ * Holds the params to one thread of eval_mm_parallel. Every thread 
+ * replays the whole trace into its own blocks array.
+ */
+typedef struct {
+    trace_t *trace;
+    char **blocks;
+    int failed;    /* set if a request returned NULL */
+} replay_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* defined for both libc malloc and student malloc package (mm.c) */
@@ -84,6 +183,10 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
+    double footprint;/* heap and mapped bytes still held at the end of the trace */
+    double mapped;   /* most bytes in mappings of their own at any time */
+    double committed;/* heap bytes backed by memory at the end of the trace */
+    double sbrks;    /* times the heap grew during the utilization run */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t;
@@ -93,6 +196,8 @@ typedef struct {
  *******************/
 int verbose = 0;        /* global flag for verbose output */
 static int errors = 0;  /* number of errs found when running student malloc */
+static int try_expand = 0;     /* reallocs try mm_try_expand first (set by -x) */
+static unsigned long expanded; /* reallocs mm_try_expand did in place in the last run */
 char msg[MAXLINE];      /* for whenever we need to compose an error message */
 
 /* Directory where default tracefiles are found */
@@ -108,7 +213,9 @@ static char *default_tracefiles[] = {
  * Function prototypes 
  *********************/
 
-/* these functions manipulate range lists */
+/* these functions manipulate range trees */
+static range_t *splay_range(range_t *t, char *lo);
+
 static int add_range(range_t **ranges, char *lo, int size,
                      int tracenum, int opnum);
 
@@ -119,8 +226,36 @@ static void clear_ranges(range_t **ranges);
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(char *tracedir, char *filename);
 
+static int read_op(FILE *tracefile, traceop_t *op, char *path);
+
+static void map_trace(trace_t *trace, FILE *tracefile, trace_header_t *header, char *path);
+
+static void check_header(trace_header_t *header, char *path);
+
+static int bad_op(traceop_t *op, int num_ids);
+
+static void write_trace(trace_t *trace, char *path);
+
 static void free_trace(trace_t *trace);
 
+/* These functions stream a trace through a pair of buffers */
+static void open_stream(stream_t *stream, char *tracedir, char *filename);
+
+static void *read_stream(void *ptr);
+
+static int next_chunk(stream_t *stream, traceop_t **ops);
+
+static void close_stream(stream_t *stream);
+
+/* These functions manipulate the id table of a streamed trace */
+static void init_ids(idtable_t *ids, size_t nslots);
+
+static live_t *find_id(idtable_t *ids, int id);
+
+static void add_id(idtable_t *ids, int id, char *p, int size);
+
+static void remove_id(idtable_t *ids, live_t *e);
+
 /* Routines for evaluating the correctness and speed of libc malloc */
 static int eval_libc_valid(trace_t *trace, int tracenum);
 
@@ -134,6 +269,30 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
 
 static void eval_mm_speed(void *ptr);
 
+/* Evaluates the mm package on a trace it streams instead of loading (-s) */
+static int eval_mm_stream(char *tracedir, char *filename, int tracenum,
+                          range_t **ranges, stats_t *stats);
+
+static int replay_stream(char *tracedir, char *filename, int tracenum,
+                         range_t **ranges, double *ops, double *util);
+
+static int check_new_block(range_t **ranges, traceop_t *op, int id, char *p,
+                           int tracenum, int opnum);
+
+/* Replays a trace in several threads at once and reports the arenas */
+static void eval_mm_parallel(trace_t *trace, int tracenum, int nthreads);
+
+static void *replay_mm_thread(void *ptr);
+
+/* mm_realloc, or mm_try_expand with -x */
+static char *resize_block(char *oldp, int size);
+
+/* Sums the counters of all arenas of the mm package */
+static void sum_arena_stats(ArenaStats *total);
+
+/* Records the heap footprint of the last run in stats */
+static void record_heap_stats(stats_t *stats, int tracenum);
+
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
 
@@ -163,7 +322,11 @@ int main(int argc, char **argv) {
     speed_t speed_params;      /* input parameters to the xx_speed routines */
 
     int run_libc = 0;    /* If set, run libc malloc (set by -l) */
+    int nthreads = 0;    /* If set, also replay in nthreads threads (-p) */
+    int stream = 0;      /* If set, stream the traces instead of loading them (-s) */
+    size_t max_heap = MAX_HEAP; /* Size of the simulated heap (-m) */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
+    char *binary_out = NULL; /* If set, convert the -f trace to this binary file (-w) */
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, avg_mm_util, avg_mm_throughput, p1, p2, perfindex;
@@ -172,7 +335,7 @@ int main(int argc, char **argv) {
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVglc:")) != EOF) {
+    while ((c = getopt(argc, argv, "f:t:hvVglsxc:p:m:w:")) != EOF) {
         switch (c) {
             case 'g': /* Generate summary info for the autograder */
                 autograder = 1;
@@ -204,6 +367,29 @@ int main(int argc, char **argv) {
             case 'c':
                 exit_code = atoi(optarg);
                 break;
+            case 's': /* Stream the traces through the mm package */
+                stream = 1;
+                break;
+            case 'x': /* Grow blocks with mm_try_expand before mm_realloc */
+                try_expand = 1;
+                break;
+            case 'p': /* Replay each trace concurrently in n threads */
+                nthreads = atoi(optarg);
+                if (nthreads < 1) {
+                    usage();
+                    exit(1);
+                }
+                break;
+            case 'm': /* Size of the simulated heap in MB */
+                max_heap = (size_t) strtoul(optarg, NULL, 0) << 20;
+                if (max_heap == 0) {
+                    usage();
+                    exit(1);
+                }
+                break;
+            case 'w': /* Write the trace as a binary trace file and exit */
+                binary_out = optarg;
+                break;
             case 'h': /* Print this message */
                 usage();
                 exit(0);
@@ -213,6 +399,24 @@ int main(int argc, char **argv) {
         }
     }
 
+    /* Streamed traces are never in memory, which libc and -p replays need */
+    if (stream && (run_libc || nthreads)) {
+        usage();
+        exit(1);
+    }
+
+    /* Converting a trace needs exactly one, given with -f */
+    if (binary_out != NULL) {
+        if (tracefiles == NULL) {
+            usage();
+            exit(1);
+        }
+        trace = read_trace(tracedir, tracefiles[0]);
+        write_trace(trace, binary_out);
+        free_trace(trace);
+        exit(0);
+    }
+
     /* 
      * If no -f command line arg, then use the entire set of tracefiles 
      * defined in default_traces[]
@@ -273,31 +477,42 @@ int main(int argc, char **argv) {
         unix_error("mm_stats calloc in main failed");
 
     /* Initialize the simulated memory system in memlib.c */
-    mem_init();
+    mem_init_size(max_heap);
 
     /* Evaluate student's mm malloc package using the K-best scheme */
     for (i = 0; i < num_tracefiles; i++) {
+        expanded = 0;
+        if (stream) {
+            mm_stats[i].valid = eval_mm_stream(tracedir, tracefiles[i], i,
+                                               &ranges, &mm_stats[i]);
+            continue;
+        }
         trace = read_trace(tracedir, tracefiles[i]);
         mm_stats[i].ops = trace->num_ops;
         if (verbose > 1)
             printf("Checking mm_malloc for correctness, ");
         mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
+        if (try_expand && verbose)
+            printf("trace %d: mm_try_expand grew %lu blocks in place\n", i, expanded);
         if (mm_stats[i].valid) {
             if (verbose > 1)
                 printf("efficiency, ");
             mm_stats[i].util = eval_mm_util(trace, i, &ranges);
+            record_heap_stats(&mm_stats[i], i);
             speed_params.trace = trace;
             speed_params.ranges = ranges;
             if (verbose > 1)
                 printf("and performance.\n");
             mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+            if (nthreads)
+                eval_mm_parallel(trace, i, nthreads);
         }
         free_trace(trace);
     }
 
     /* Display the mm results in a compact table */
     if (verbose) {
-        printf("\nResults for mm malloc:\n");
+        printf("\nResults for mm malloc (%s placement):\n", mm_policy_name());
         printresults(num_tracefiles, mm_stats);
         printf("\n");
     }
@@ -353,21 +568,78 @@ int main(int argc, char **argv) {
 
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps 
+ * The following routines manipulate the range tree, which keeps 
  * track of the extent of every allocated block payload. We use the 
- * range list to detect any overlapping allocated blocks.
+ * range tree to detect any overlapping allocated blocks. Payloads
+ * never overlap, so ordering them by lo also orders them by hi, and
+ * a new payload can only collide with its two neighbours in the tree.
+ * The tree is a splay tree, so a trace with n live blocks costs
+ * O(log n) per request instead of the O(n) a list walk took.
  ****************************************************************/
 
+/*
+ * splay_range - Top-down splay. Brings the range starting at lo to the 
+ *     root of t, or, if there is none, the range that was last visited 
+ *     looking for it, which is the closest one below or above lo.
+ */
+static range_t *splay_range(range_t *t, char *lo) {
+    range_t n, *l, *r, *y;
+
+    if (t == NULL)
+        return NULL;
+    n.left = n.right = NULL;
+    l = r = &n;
+
+    for (;;) {
+        if (lo < t->lo) {
+            if (t->left == NULL)
+                break;
+            if (lo < t->left->lo) {           /* rotate right */
+                y = t->left;
+                t->left = y->right;
+                y->right = t;
+                t = y;
+                if (t->left == NULL)
+                    break;
+            }
+            r->left = t;                      /* link right */
+            r = t;
+            t = t->left;
+        } else if (lo > t->lo) {
+            if (t->right == NULL)
+                break;
+            if (lo > t->right->lo) {          /* rotate left */
+                y = t->right;
+                t->right = y->left;
+                y->left = t;
+                t = y;
+                if (t->right == NULL)
+                    break;
+            }
+            l->right = t;                     /* link left */
+            l = t;
+            t = t->right;
+        } else {
+            break;
+        }
+    }
+    l->right = t->left;                       /* assemble */
+    r->left = t->right;
+    t->left = n.right;
+    t->right = n.left;
+    return t;
+}
+
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of 
  *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list. 
+ *     we create a range struct for this block and add it to the range tree. 
  */
 static int add_range(range_t **ranges, char *lo, int size,
                      int tracenum, int opnum) {
     char *hi = lo + size - 1;
-    range_t *p;
+    range_t *p, *root, *below, *above;
     char msg[MAXLINE];
 
     assert(size > 0);
@@ -380,35 +652,69 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *) mem_heap_lo()) || (lo > (char *) mem_heap_hi()) ||
-        (hi < (char *) mem_heap_lo()) || (hi > (char *) mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap or of a mapping */
+    if (((lo < (char *) mem_heap_lo()) || (lo > (char *) mem_heap_hi()) ||
+         (hi < (char *) mem_heap_lo()) || (hi > (char *) mem_heap_hi())) &&
+        !mem_is_mapped(lo, hi)) {
         sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
                 lo, hi, mem_heap_lo(), mem_heap_hi());
         malloc_error(tracenum, opnum, msg);
         return 0;
     }
 
-    /* The payload must not overlap any other payloads */
-    for (p = *ranges; p != NULL; p = p->next) {
-        if ((lo >= p->lo && lo <= p->hi) ||
-            (hi >= p->lo && hi <= p->hi)) {
-            sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
-                    lo, hi, p->lo, p->hi);
-            malloc_error(tracenum, opnum, msg);
-            return 0;
+    /* The package must know the block is at least that large */
+    if (mm_usable_size(lo) < (size_t) size) {
+        sprintf(msg, "Payload (%p) has %lu usable bytes, fewer than the %d asked for",
+                lo, (unsigned long) mm_usable_size(lo), size);
+        malloc_error(tracenum, opnum, msg);
+        return 0;
+    }
+
+    /* 
+     * The payload must not overlap any other payloads. After the splay 
+     * the root is one neighbour of lo; splaying its subtree on the other 
+     * side brings up the other neighbour.
+     */
+    root = *ranges = splay_range(*ranges, lo);
+    below = above = NULL;
+    if (root != NULL) {
+        if (root->lo <= lo) {
+            below = root;
+            above = root->right = splay_range(root->right, lo);
+        } else {
+            above = root;
+            below = root->left = splay_range(root->left, lo);
         }
     }
+    p = (below != NULL && below->hi >= lo) ? below :
+        (above != NULL && above->lo <= hi) ? above : NULL;
+    if (p != NULL) {
+        sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
+                lo, hi, p->lo, p->hi);
+        malloc_error(tracenum, opnum, msg);
+        return 0;
+    }
 
     /* 
      * Everything looks OK, so remember the extent of this block 
-     * by creating a range struct and adding it the range list.
+     * by creating a range struct and making it the root of the tree.
      */
     if ((p = (range_t *) malloc(sizeof(range_t))) == NULL)
         unix_error("malloc error in add_range");
-    p->next = *ranges;
     p->lo = lo;
     p->hi = hi;
+    p->left = p->right = NULL;
+    if (root != NULL) {
+        if (root->lo < lo) {
+            p->left = root;
+            p->right = root->right;
+            root->right = NULL;
+        } else {
+            p->right = root;
+            p->left = root->left;
+            root->left = NULL;
+        }
+    }
     *ranges = p;
     return 1;
 }
@@ -417,48 +723,147 @@ static int add_range(range_t **ranges, char *lo, int size,
  * remove_range - Free the range record of block whose payload starts at lo 
  */
 static void remove_range(range_t **ranges, char *lo) {
-    range_t *p;
-    range_t **prevpp = ranges;
+    range_t *p = *ranges = splay_range(*ranges, lo);
 
-    for (p = *ranges; p != NULL; p = p->next) {
-        if (p->lo == lo) {
-            *prevpp = p->next;
-            free(p);
-            break;
-        }
-        prevpp = &(p->next);
+    if (p == NULL || p->lo != lo)
+        return;
+
+    /* Every range left of p starts below lo, so the splay makes the highest the root */
+    if (p->left == NULL) {
+        *ranges = p->right;
+    } else {
+        *ranges = splay_range(p->left, lo);
+        (*ranges)->right = p->right;
     }
+    free(p);
 }
 
 /*
  * clear_ranges - free all of the range records for a trace 
  */
 static void clear_ranges(range_t **ranges) {
-    range_t *p;
-    range_t *pnext;
-
-    for (p = *ranges; p != NULL; p = pnext) {
-        pnext = p->next;
-        free(p);
+    range_t *p = *ranges;
+    range_t *l;
+
+    /* Rotate left children up until the root has none, then free it; no recursion needed */
+    while (p != NULL) {
+        if (p->left != NULL) {
+            l = p->left;
+            p->left = l->right;
+            l->right = p;
+            p = l;
+        } else {
+            l = p->right;
+            free(p);
+            p = l;
+        }
     }
     *ranges = NULL;
 }
 
 
+/*****************************************************************
+ * The following routines manipulate the id table, which maps the
+ * request ids of a streamed trace to their live blocks. Ids are 
+ * hashed into a power-of-two table with linear probing, kept at 
+ * most half full, so memory follows the live blocks of the trace 
+ * rather than the number of ids it uses.
+ ****************************************************************/
+
+/* Spreads consecutive ids over the table */
+#define HASH_ID(id) ((size_t) (((uint64_t) (uint32_t) (id) * 0x9E3779B97F4A7C15ULL) >> 32))
+
+/*
+ * init_ids - Make ids an empty table of nslots slots, a power of two
+ */
+static void init_ids(idtable_t *ids, size_t nslots) {
+    size_t i;
+
+    if ((ids->slots = (live_t *) malloc(nslots * sizeof(live_t))) == NULL)
+        unix_error("malloc error in init_ids");
+    for (i = 0; i < nslots; i++)
+        ids->slots[i].id = -1;
+    ids->mask = nslots - 1;
+    ids->used = 0;
+}
+
+/*
+ * find_id - Returns the live block with request id, or NULL
+ */
+static live_t *find_id(idtable_t *ids, int id) {
+    size_t i;
+
+    for (i = HASH_ID(id) & ids->mask; ids->slots[i].id >= 0; i = (i + 1) & ids->mask)
+        if (ids->slots[i].id == id)
+            return &ids->slots[i];
+    return NULL;
+}
+
+/*
+ * add_id - Record the block of request id, which must not be live.
+ *     Doubles the table first if that would make it over half full.
+ */
+static void add_id(idtable_t *ids, int id, char *p, int size) {
+    idtable_t bigger;
+    size_t i;
+
+    if (2 * (ids->used + 1) > ids->mask + 1) {
+        init_ids(&bigger, 2 * (ids->mask + 1));
+        for (i = 0; i <= ids->mask; i++)
+            if (ids->slots[i].id >= 0)
+                add_id(&bigger, ids->slots[i].id, ids->slots[i].p, ids->slots[i].size);
+        free(ids->slots);
+        *ids = bigger;
+    }
+
+    for (i = HASH_ID(id) & ids->mask; ids->slots[i].id >= 0; i = (i + 1) & ids->mask)
+        ;
+    ids->slots[i].id = id;
+    ids->slots[i].p = p;
+    ids->slots[i].size = size;
+    ids->used++;
+}
+
+/*
+ * remove_id - Forget the block in slot e. The blocks after it in its 
+ *     probe run move back over the hole, so lookups never need 
+ *     tombstones.
+ */
+static void remove_id(idtable_t *ids, live_t *e) {
+    size_t hole = e - ids->slots;
+    size_t i = hole;
+    size_t home;
+
+    for (;;) {
+        i = (i + 1) & ids->mask;
+        if (ids->slots[i].id < 0)
+            break;
+        home = HASH_ID(ids->slots[i].id) & ids->mask;
+        /* The block in slot i can fill the hole unless its home lies between them */
+        if ((i > hole) ? (home <= hole || home > i) : (home <= hole && home > i)) {
+            ids->slots[hole] = ids->slots[i];
+            hole = i;
+        }
+    }
+    ids->slots[hole].id = -1;
+    ids->used--;
+}
+
 /**********************************************
  * The following routines manipulate tracefiles
  *********************************************/
 
 /*
- * read_trace - read a trace file and store it in memory
+ * read_trace - read a trace file and store it in memory. Binary trace 
+ *     files are mapped instead, see map_trace.
  */
 static trace_t *read_trace(char *tracedir, char *filename) {
     FILE *tracefile;
     trace_t *trace;
-    char type[MAXLINE];
+    trace_header_t header;
+    traceop_t *op;
     char path[MAXLINE];
-    unsigned index, size;
-    unsigned max_index = 0;
+    unsigned last, max_index = 0;
     unsigned op_index;
     int convs;
 
@@ -478,6 +883,18 @@ static trace_t *read_trace(char *tracedir, char *filename) {
         }
         unix_error(msg);
     }
+    trace->map = NULL;
+    trace->map_size = 0;
+
+    /* Binary trace files are recognized by their magic number */
+    if (fread(&header, sizeof(header), 1, tracefile) == 1 &&
+        memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) == 0) {
+        map_trace(trace, tracefile, &header, path);
+        fclose(tracefile);
+        goto alloc_blocks;
+    }
+    rewind(tracefile);
+
     convs = fscanf(tracefile, "%d", &(trace->sugg_heapsize)); /* not used */
     if (convs != 1) app_error("tracefile format");
     convs = fscanf(tracefile, "%d", &(trace->num_ids));
@@ -492,6 +909,22 @@ static trace_t *read_trace(char *tracedir, char *filename) {
                  (traceop_t *) malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
         unix_error("malloc 2 failed in read_trace");
 
+    /* read every request line in the trace file */
+    op_index = 0;
+    while (op_index < (unsigned) trace->num_ops &&
+           read_op(tracefile, &trace->ops[op_index], path)) {
+        op = &trace->ops[op_index];
+        if (op->type != FREE && op->type != FREE_BATCH) {
+            last = (op->type == ALLOC_BATCH) ? op->index + OP_COUNT(op) - 1 : op->index;
+            max_index = (last > max_index) ? last : max_index;
+        }
+        op_index++;
+    }
+    fclose(tracefile);
+    assert(max_index == trace->num_ids - 1);
+    assert(trace->num_ops == op_index);
+
+alloc_blocks:
     /* We'll keep an array of pointers to the allocated blocks here... */
     if ((trace->blocks =
                  (char **) malloc(trace->num_ids * sizeof(char *))) == NULL)
@@ -502,59 +935,305 @@ static trace_t *read_trace(char *tracedir, char *filename) {
                  (size_t *) malloc(trace->num_ids * sizeof(size_t))) == NULL)
         unix_error("malloc 4 failed in read_trace");
 
-    /* read every request line in the trace file */
-    index = 0;
-    op_index = 0;
-    while (fscanf(tracefile, "%s", type) != EOF) {
-        switch (type[0]) {
-            case 'a':
-                convs = fscanf(tracefile, "%u %u", &index, &size);
-                if (convs != 2) app_error("tracefile format");
-                trace->ops[op_index].type = ALLOC;
-                trace->ops[op_index].index = index;
-                trace->ops[op_index].size = size;
-                max_index = (index > max_index) ? index : max_index;
-                break;
-            case 'r':
-                convs = fscanf(tracefile, "%u %u", &index, &size);
-                if (convs != 2) app_error("tracefile format");
-                trace->ops[op_index].type = REALLOC;
-                trace->ops[op_index].index = index;
-                trace->ops[op_index].size = size;
-                max_index = (index > max_index) ? index : max_index;
-                break;
-            case 'f':
-                convs = fscanf(tracefile, "%ud", &index);
-                if (convs != 1) app_error("tracefile format");
-                trace->ops[op_index].type = FREE;
-                trace->ops[op_index].index = index;
-                break;
-            default:
-                printf("Bogus type character (%c) in tracefile %s\n",
-                       type[0], path);
-                exit(1);
-        }
-        op_index++;
+    return trace;
+}
+
+/*
+ * read_op - Parse the next request line of a text trace file into op.
+ *     Returns 0 at the end of the file.
+ */
+static int read_op(FILE *tracefile, traceop_t *op, char *path) {
+    char type[MAXLINE];
+    unsigned index, size, count, alignment;
+    int convs;
 
+    if (fscanf(tracefile, "%s", type) == EOF)
+        return 0;
+    switch (type[0]) {
+        case 'a':
+            convs = fscanf(tracefile, "%u %u", &index, &size);
+            if (convs != 2) app_error("tracefile format");
+            op->type = ALLOC;
+            op->index = index;
+            op->size = size;
+            break;
+        case 'r':
+            convs = fscanf(tracefile, "%u %u", &index, &size);
+            if (convs != 2) app_error("tracefile format");
+            op->type = REALLOC;
+            op->index = index;
+            op->size = size;
+            break;
+        case 'f':
+            convs = fscanf(tracefile, "%ud", &index);
+            if (convs != 1) app_error("tracefile format");
+            op->type = FREE;
+            op->index = index;
+            break;
+        case 'A':
+            convs = fscanf(tracefile, "%u %u %u", &index, &size, &count);
+            if (convs != 3 || count == 0 || count > MAX_BATCH) app_error("tracefile format");
+            op->type = ALLOC_BATCH;
+            op->index = index;
+            op->size = size;
+            op->arg = count;
+            break;
+        case 'm':
+            convs = fscanf(tracefile, "%u %u %u", &index, &size, &alignment);
+            if (convs != 3 || alignment == 0 || (alignment & (alignment - 1)) != 0)
+                app_error("tracefile format");
+            op->type = MEMALIGN;
+            op->index = index;
+            op->size = size;
+            for (op->arg = 0; (1u << op->arg) < alignment; op->arg++)
+                ;
+            break;
+        case 'c':
+            convs = fscanf(tracefile, "%u %u", &index, &size);
+            if (convs != 2) app_error("tracefile format");
+            op->type = CALLOC;
+            op->index = index;
+            op->size = size;
+            break;
+        case 'F':
+            convs = fscanf(tracefile, "%u %u", &index, &count);
+            if (convs != 2 || count == 0 || count > MAX_BATCH) app_error("tracefile format");
+            op->type = FREE_BATCH;
+            op->index = index;
+            op->arg = count;
+            break;
+        default:
+            printf("Bogus type character (%c) in tracefile %s\n",
+                   type[0], path);
+            exit(1);
     }
-    fclose(tracefile);
-    assert(max_index == trace->num_ids - 1);
-    assert(trace->num_ops == op_index);
+    return 1;
+}
 
-    return trace;
+/*
+ * map_trace - Map the binary trace file whose header read_trace has 
+ *     just read. The ops are used in place, so a trace of any length 
+ *     loads in the time it takes to check them once.
+ */
+static void map_trace(trace_t *trace, FILE *tracefile, trace_header_t *header, char *path) {
+    struct stat st;
+    int i;
+
+    check_header(header, path);
+    if (fstat(fileno(tracefile), &st) < 0)
+        unix_error("fstat failed in map_trace");
+    if (header->num_ids < 0 || header->num_ops < 0 ||
+        (size_t) st.st_size != sizeof(trace_header_t) + (size_t) header->num_ops * sizeof(traceop_t))
+        app_error("binary tracefile format");
+
+    trace->sugg_heapsize = header->sugg_heapsize;
+    trace->num_ids = header->num_ids;
+    trace->num_ops = header->num_ops;
+    trace->weight = header->weight;
+    trace->map_size = st.st_size;
+    trace->map = mmap(NULL, trace->map_size, PROT_READ, MAP_PRIVATE, fileno(tracefile), 0);
+    if (trace->map == MAP_FAILED)
+        unix_error("mmap failed in map_trace");
+    trace->ops = (traceop_t *) ((char *) trace->map + sizeof(trace_header_t));
+
+    /* The same checks the text parser makes, so a bad file can't index past blocks[] */
+    for (i = 0; i < trace->num_ops; i++)
+        if (bad_op(&trace->ops[i], trace->num_ids))
+            app_error("binary tracefile format");
+}
+
+/*
+ * check_header - Make sure a binary trace file was written by this 
+ *     version of mdriver on a machine with the same byte order.
+ */
+static void check_header(trace_header_t *header, char *path) {
+    if (header->version != TRACE_VERSION || header->op_bytes != sizeof(traceop_t)) {
+        sprintf(msg, "%s is a binary trace of another version or byte order", path);
+        app_error(msg);
+    }
+}
+
+/*
+ * bad_op - Returns true if an op read from a binary trace file is not 
+ *     one the text parser would have produced for ids below num_ids.
+ */
+static int bad_op(traceop_t *op, int num_ids) {
+    long last = op->index;
+
+    if (op->type == ALLOC_BATCH || op->type == FREE_BATCH)
+        last = (op->arg > 0) ? (long) op->index + OP_COUNT(op) - 1 : -1;
+    return op->type > CALLOC || op->index < 0 ||
+           last < op->index || last >= num_ids || op->size < 0 ||
+           (op->type == MEMALIGN && op->arg > 31);
+}
+
+/*
+ * write_trace - Write a trace as a binary trace file that read_trace 
+ *     can map. This is how mdriver -w converts .rep files.
+ */
+static void write_trace(trace_t *trace, char *path) {
+    FILE *out;
+    trace_header_t header;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.op_bytes = sizeof(traceop_t);
+    header.sugg_heapsize = trace->sugg_heapsize;
+    header.num_ids = trace->num_ids;
+    header.num_ops = trace->num_ops;
+    header.weight = trace->weight;
+
+    if ((out = fopen(path, "wb")) == NULL) {
+        sprintf(msg, "Could not create %s in write_trace", path);
+        unix_error(msg);
+    }
+    if (fwrite(&header, sizeof(header), 1, out) != 1 ||
+        fwrite(trace->ops, sizeof(traceop_t), trace->num_ops, out) != (size_t) trace->num_ops ||
+        fclose(out) != 0)
+        unix_error("write failed in write_trace");
 }
 
 /*
  * free_trace - Free the trace record and the three arrays it points
  *              to, all of which were allocated in read_trace().
+ *              The ops of a binary trace are unmapped instead.
  */
 void free_trace(trace_t *trace) {
-    free(trace->ops);         /* free the three arrays... */
+    if (trace->map != NULL)
+        munmap(trace->map, trace->map_size);
+    else
+        free(trace->ops);     /* free the three arrays... */
     free(trace->blocks);
     free(trace->block_sizes);
     free(trace);              /* and the trace record itself... */
 }
 
+/*
+ * open_stream - Open a text or binary trace file for streaming and 
+ *     start the thread that reads it ahead of the replay.
+ */
+static void open_stream(stream_t *stream, char *tracedir, char *filename) {
+    trace_header_t header;
+    int i, header_field;
+
+    strcpy(stream->path, tracedir);
+    strcat(stream->path, filename);
+    if ((stream->file = fopen(stream->path, "r")) == NULL) {
+        sprintf(msg, "Could not open %s in open_stream", stream->path);
+        unix_error(msg);
+    }
+
+    /* Skip the header, the ids and ops it counts don't matter here */
+    stream->binary = fread(&header, sizeof(header), 1, stream->file) == 1 &&
+                     memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) == 0;
+    if (stream->binary) {
+        check_header(&header, stream->path);
+    } else {
+        rewind(stream->file);
+        for (i = 0; i < HDRLINES; i++)
+            if (fscanf(stream->file, "%d", &header_field) != 1)
+                app_error("tracefile format");
+    }
+
+    for (i = 0; i < 2; i++) {
+        if ((stream->bufs[i] = (traceop_t *) malloc(STREAM_CHUNK * sizeof(traceop_t))) == NULL)
+            unix_error("malloc error in open_stream");
+        stream->counts[i] = 0;
+        stream->full[i] = 0;
+    }
+    stream->cur = 0;
+    stream->held = 0;
+    stream->stop = 0;
+    pthread_mutex_init(&stream->lock, NULL);
+    pthread_cond_init(&stream->cond, NULL);
+    if (pthread_create(&stream->reader, NULL, read_stream, stream) != 0)
+        unix_error("pthread_create failed in open_stream");
+}
+
+/*
+ * read_stream - The reader thread of a stream. Fills whichever buffer 
+ *     the replay has handed back, until the file ends or close_stream 
+ *     tells it to stop. An empty buffer marks the end.
+ */
+static void *read_stream(void *ptr) {
+    stream_t *stream = (stream_t *) ptr;
+    traceop_t *ops;
+    int b = 0;
+    int i, n, stop;
+
+    do {
+        pthread_mutex_lock(&stream->lock);
+        while (stream->full[b] && !stream->stop)
+            pthread_cond_wait(&stream->cond, &stream->lock);
+        stop = stream->stop;
+        pthread_mutex_unlock(&stream->lock);
+        if (stop)
+            break;
+
+        ops = stream->bufs[b];
+        if (stream->binary) {
+            n = fread(ops, sizeof(traceop_t), STREAM_CHUNK, stream->file);
+            for (i = 0; i < n; i++)
+                if (bad_op(&ops[i], INT_MAX))
+                    app_error("binary tracefile format");
+        } else {
+            for (n = 0; n < STREAM_CHUNK && read_op(stream->file, &ops[n], stream->path); n++)
+                ;
+        }
+
+        pthread_mutex_lock(&stream->lock);
+        stream->counts[b] = n;
+        stream->full[b] = 1;
+        pthread_cond_broadcast(&stream->cond);
+        pthread_mutex_unlock(&stream->lock);
+        b ^= 1;
+    } while (n > 0);
+    return NULL;
+}
+
+/*
+ * next_chunk - Hand the buffer the replay is done with back to the 
+ *     reader and wait for the next one. Returns the number of ops in 
+ *     it, 0 at the end of the trace.
+ */
+static int next_chunk(stream_t *stream, traceop_t **ops) {
+    int n;
+
+    pthread_mutex_lock(&stream->lock);
+    if (stream->held) {
+        stream->full[stream->cur] = 0;
+        stream->cur ^= 1;
+        pthread_cond_broadcast(&stream->cond);
+    }
+    while (!stream->full[stream->cur])
+        pthread_cond_wait(&stream->cond, &stream->lock);
+    n = stream->counts[stream->cur];
+    stream->held = 1;
+    pthread_mutex_unlock(&stream->lock);
+
+    *ops = stream->bufs[stream->cur];
+    return n;
+}
+
+/*
+ * close_stream - Stop the reader, which may still be ahead of a replay 
+ *     that gave up early, and free the stream.
+ */
+static void close_stream(stream_t *stream) {
+    pthread_mutex_lock(&stream->lock);
+    stream->stop = 1;
+    pthread_cond_broadcast(&stream->cond);
+    pthread_mutex_unlock(&stream->lock);
+    pthread_join(stream->reader, NULL);
+
+    fclose(stream->file);
+    free(stream->bufs[0]);
+    free(stream->bufs[1]);
+    pthread_mutex_destroy(&stream->lock);
+    pthread_cond_destroy(&stream->cond);
+}
+
 /**********************************************************************
  * The following functions evaluate the correctness, space utilization,
  * and throughput of the libc and mm malloc packages.
@@ -567,12 +1246,13 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) {
     int i, j;
     int index;
     int size;
+    int count;
     int oldsize;
     char *newp;
     char *oldp;
     char *p;
 
-    /* Reset the heap and free any records in the range list */
+    /* Reset the heap and free any records in the range tree */
     mem_reset_brk();
     clear_ranges(ranges);
 
@@ -589,6 +1269,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) {
     for (i = 0; i < trace->num_ops; i++) {
         index = trace->ops[i].index;
         size = trace->ops[i].size;
+        count = OP_COUNT(&trace->ops[i]);
         switch (trace->ops[i].type) {
 
             case ALLOC: /* mm_malloc */
@@ -601,7 +1282,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) {
 
                 /*
                  * Test the range of the new block for correctness and add it
-                 * to the range list if OK. The block must be aligned properly,
+                 * to the range tree if OK. The block must be aligned properly,
                  * and must not overlap any currently allocated block.
                  */
                 if (add_range(ranges, p, size, tracenum, i) == 0)
@@ -625,15 +1306,15 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) {
                 r++;
                 /* Call the student's realloc */
                 oldp = trace->blocks[index];
-                if ((newp = mm_realloc(oldp, size)) == NULL) {
+                if ((newp = resize_block(oldp, size)) == NULL) {
                     malloc_error(tracenum, i, "mm_realloc failed.");
                     return 0;
                 }
 
-                /* Remove the old region from the range list */
+                /* Remove the old region from the range tree */
                 remove_range(ranges, oldp);
 
-                /* Check new block for correctness and add it to range list */
+                /* Check new block for correctness and add it to range tree */
                 if (add_range(ranges, newp, size, tracenum, i) == 0)
                     return 0;
 
@@ -666,6 +1347,67 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) {
                 mm_free(p);
                 break;
 
+            case CALLOC: /* mm_calloc */
+                a++;
+                if ((p = mm_calloc(1, size)) == NULL) {
+                    malloc_error(tracenum, i, "mm_calloc failed.");
+                    return 0;
+                }
+                for (j = 0; j < size; j++) {
+                    if (p[j] != 0) {
+                        malloc_error(tracenum, i, "mm_calloc returned a block that is not zeroed.");
+                        return 0;
+                    }
+                }
+                if (add_range(ranges, p, size, tracenum, i) == 0)
+                    return 0;
+                memset(p, (index & 0xFF) | 0xAA, size);
+                trace->blocks[index] = p;
+                trace->block_sizes[index] = size;
+                break;
+
+            case MEMALIGN: /* mm_memalign */
+                a++;
+                if ((p = mm_memalign(OP_ALIGNMENT(&trace->ops[i]), size)) == NULL) {
+                    malloc_error(tracenum, i, "mm_memalign failed.");
+                    return 0;
+                }
+                if ((uintptr_t) p % OP_ALIGNMENT(&trace->ops[i]) != 0) {
+                    malloc_error(tracenum, i, "mm_memalign returned a misaligned block.");
+                    return 0;
+                }
+                if (add_range(ranges, p, size, tracenum, i) == 0)
+                    return 0;
+                memset(p, (index & 0xFF) | 0xAA, size);
+                trace->blocks[index] = p;
+                trace->block_sizes[index] = size;
+                break;
+
+            case ALLOC_BATCH: /* mm_malloc_batch */
+                a += count;
+                /* The batch lands right in the blocks of its ids */
+                if (mm_malloc_batch(size, count, (void **) &trace->blocks[index]) != (size_t) count) {
+                    malloc_error(tracenum, i, "mm_malloc_batch failed.");
+                    return 0;
+                }
+
+                /* Every block of the batch is checked and filled like a single one */
+                for (j = 0; j < count; j++) {
+                    p = trace->blocks[index + j];
+                    if (add_range(ranges, p, size, tracenum, i) == 0)
+                        return 0;
+                    memset(p, ((index + j) & 0xFF) | 0xAA, size);
+                    trace->block_sizes[index + j] = size;
+                }
+                break;
+
+            case FREE_BATCH: /* mm_free_batch */
+                f += count;
+                for (j = 0; j < count; j++)
+                    remove_range(ranges, trace->blocks[index + j]);
+                mm_free_batch((void **) &trace->blocks[index], count);
+                break;
+
             default:
                 app_error("Nonexistent request type in eval_mm_valid");
         }
@@ -680,24 +1422,26 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) {
  * eval_mm_util - Evaluate the space utilization of the student's package
  *   The idea is to remember the high water mark "hwm" of the heap for 
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
- *   Utilization is the ratio hwm/heapsize, where heapsize is the 
- *   size of the heap in bytes after running the student's malloc 
- *   package on the trace. Note that our implementation of mem_sbrk() 
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap. 
- *   
+ *   Utilization is the ratio hwm/footprint, where footprint is the 
+ *   high water mark of the space the student's package held while 
+ *   running the trace: the heap up to the brk of each region plus the 
+ *   blocks mapped on their own. The package may give memory back, by 
+ *   trimming a region with a negative mem_region_sbrk() or by 
+ *   decommitting free pages, but that can't lower the peak it reached. 
+ *   Decommitted pages still lie below brk and count towards it.
  */
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges) {
-    int i;
-    int index;
+    int i, j;
+    int index, count;
     int size, newsize, oldsize;
     int max_total_size = 0;
     int total_size = 0;
     char *p;
     char *newp, *oldp;
 
-    /* initialize the heap and the mm malloc package */
+    /* initialize the heap and the mm malloc package, starting with nothing committed */
     mem_reset_brk();
+    mem_reset_commit();
     if (mm_init() < 0)
         app_error("mm_init failed in eval_mm_util");
 
@@ -730,7 +1474,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges) {
                 oldsize = trace->block_sizes[index];
 
                 oldp = trace->blocks[index];
-                if ((newp = mm_realloc(oldp, newsize)) == NULL)
+                if ((newp = resize_block(oldp, newsize)) == NULL)
                     app_error("mm_realloc failed in eval_mm_util");
 
                 /* Remember region and size */
@@ -759,13 +1503,60 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges) {
 
                 break;
 
+            case CALLOC: /* mm_calloc */
+            case MEMALIGN: /* mm_memalign */
+                index = trace->ops[i].index;
+                size = trace->ops[i].size;
+
+                if (trace->ops[i].type == CALLOC)
+                    p = mm_calloc(1, size);
+                else
+                    p = mm_memalign(OP_ALIGNMENT(&trace->ops[i]), size);
+                if (p == NULL)
+                    app_error("mm_calloc or mm_memalign failed in eval_mm_util");
+                trace->blocks[index] = p;
+                trace->block_sizes[index] = size;
+
+                total_size += size;
+                max_total_size = (total_size > max_total_size) ?
+                                 total_size : max_total_size;
+                break;
+
+            case ALLOC_BATCH: /* mm_malloc_batch */
+                index = trace->ops[i].index;
+                size = trace->ops[i].size;
+                count = OP_COUNT(&trace->ops[i]);
+
+                if (mm_malloc_batch(size, count, (void **) &trace->blocks[index]) != (size_t) count)
+                    app_error("mm_malloc_batch failed in eval_mm_util");
+                for (j = 0; j < count; j++)
+                    trace->block_sizes[index + j] = size;
+
+                total_size += size * count;
+                max_total_size = (total_size > max_total_size) ?
+                                 total_size : max_total_size;
+                break;
+
+            case FREE_BATCH: /* mm_free_batch */
+                index = trace->ops[i].index;
+                count = OP_COUNT(&trace->ops[i]);
+
+                for (j = 0; j < count; j++)
+                    total_size -= trace->block_sizes[index + j];
+                mm_free_batch((void **) &trace->blocks[index], count);
+                break;
+
             default:
                 app_error("Nonexistent request type in eval_mm_util");
 
         }
     }
 
-    return ((double) max_total_size / (double) mem_heapsize());
+    /* 
+     * The heap may have been trimmed since, so compare to its peak.
+     * Blocks in mappings of their own count as well.
+     */
+    return ((double) max_total_size / (double) mem_peak_footprint());
 }
 
 
@@ -799,7 +1590,7 @@ static void eval_mm_speed(void *ptr) {
                 index = trace->ops[i].index;
                 newsize = trace->ops[i].size;
                 oldp = trace->blocks[index];
-                if ((newp = mm_realloc(oldp, newsize)) == NULL)
+                if ((newp = resize_block(oldp, newsize)) == NULL)
                     app_error("mm_realloc error in eval_mm_speed");
                 trace->blocks[index] = newp;
                 break;
@@ -810,11 +1601,432 @@ static void eval_mm_speed(void *ptr) {
                 mm_free(block);
                 break;
 
+            case MEMALIGN: /* mm_memalign */
+                index = trace->ops[i].index;
+                if ((p = mm_memalign(OP_ALIGNMENT(&trace->ops[i]), trace->ops[i].size)) == NULL)
+                    app_error("mm_memalign error in eval_mm_speed");
+                trace->blocks[index] = p;
+                break;
+
+            case CALLOC: /* mm_calloc */
+                index = trace->ops[i].index;
+                if ((p = mm_calloc(1, trace->ops[i].size)) == NULL)
+                    app_error("mm_calloc error in eval_mm_speed");
+                trace->blocks[index] = p;
+                break;
+
+            case ALLOC_BATCH: /* mm_malloc_batch */
+                index = trace->ops[i].index;
+                if (mm_malloc_batch(trace->ops[i].size, OP_COUNT(&trace->ops[i]),
+                                    (void **) &trace->blocks[index]) != (size_t) OP_COUNT(&trace->ops[i]))
+                    app_error("mm_malloc_batch error in eval_mm_speed");
+                break;
+
+            case FREE_BATCH: /* mm_free_batch */
+                index = trace->ops[i].index;
+                mm_free_batch((void **) &trace->blocks[index], OP_COUNT(&trace->ops[i]));
+                break;
+
             default:
                 app_error("Nonexistent request type in eval_mm_valid");
         }
 }
 
+/*
+ * eval_mm_stream - Evaluates the mm package on a trace that is streamed 
+ *    instead of loaded, so it can be longer than memory. The first 
+ *    replay checks every block like eval_mm_valid and measures the 
+ *    utilization like eval_mm_util, the second one is timed. Each 
+ *    replay reads the file again. Only the CPU time of the replaying 
+ *    thread counts, so the time includes the id table but neither the 
+ *    parsing in the reader thread nor waiting for it, even when both 
+ *    threads share one CPU.
+ */
+static int eval_mm_stream(char *tracedir, char *filename, int tracenum,
+                          range_t **ranges, stats_t *stats) {
+    struct timespec start, end;
+    double ops, util;
+
+    if (verbose > 1)
+        printf("Streaming tracefile: %s\n", filename);
+    if (!replay_stream(tracedir, filename, tracenum, ranges, &stats->ops, &stats->util))
+        return 0;
+    record_heap_stats(stats, tracenum);
+    if (try_expand && verbose)
+        printf("trace %d: mm_try_expand grew %lu blocks in place\n", tracenum, expanded);
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+    if (!replay_stream(tracedir, filename, tracenum, NULL, &ops, &util))
+        return 0;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+    stats->secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return 1;
+}
+
+/*
+ * replay_stream - Replays a streamed trace once, tracking its live 
+ *    blocks in an id table. With ranges, every block is checked and 
+ *    filled as in eval_mm_valid; without, the replay only calls the 
+ *    mm package. Freed ids may be allocated again, and a realloc of 
+ *    an id that isn't live allocates it. Sets ops to the number of 
+ *    requests and util to the utilization, returns 0 on an error.
+ */
+static int replay_stream(char *tracedir, char *filename, int tracenum,
+                         range_t **ranges, double *ops, double *util) {
+    stream_t stream;
+    idtable_t ids;
+    traceop_t *chunk, *op;
+    live_t *e;
+    char **batch = NULL;
+    int batch_len = 0;
+    char *p, *newp;
+    int i, j, n, size, oldsize, opnum;
+    int valid = 0;
+    long total_size = 0;
+    long max_total_size = 0;
+    double done = 0;
+
+    /* Reset the heap, with nothing committed, and the range tree */
+    mem_reset_brk();
+    mem_reset_commit();
+    if (ranges != NULL)
+        clear_ranges(ranges);
+    if (mm_init() < 0) {
+        malloc_error(tracenum, 0, "mm_init failed.");
+        return 0;
+    }
+
+    init_ids(&ids, 1024);
+    open_stream(&stream, tracedir, filename);
+    while ((n = next_chunk(&stream, &chunk)) > 0) {
+        for (i = 0; i < n; i++, done++) {
+            op = &chunk[i];
+            opnum = (done < INT_MAX) ? (int) done : INT_MAX;
+            size = op->size;
+            switch (op->type) {
+
+                case ALLOC: /* mm_malloc */
+                case CALLOC: /* mm_calloc */
+                case MEMALIGN: /* mm_memalign */
+                    if (find_id(&ids, op->index) != NULL) {
+                        malloc_error(tracenum, opnum, "id allocated again before it was freed.");
+                        goto out;
+                    }
+                    if (op->type == ALLOC)
+                        p = mm_malloc(size);
+                    else if (op->type == CALLOC)
+                        p = mm_calloc(1, size);
+                    else
+                        p = mm_memalign(OP_ALIGNMENT(op), size);
+                    if (p == NULL) {
+                        malloc_error(tracenum, opnum, "mm_malloc, mm_calloc or mm_memalign failed.");
+                        goto out;
+                    }
+                    if (ranges != NULL &&
+                        !check_new_block(ranges, op, op->index, p, tracenum, opnum))
+                        goto out;
+                    add_id(&ids, op->index, p, size);
+                    total_size += size;
+                    break;
+
+                case REALLOC: /* mm_realloc */
+                    e = find_id(&ids, op->index);
+                    oldsize = (e != NULL) ? e->size : 0;
+                    newp = (e != NULL) ? resize_block(e->p, size) : mm_malloc(size);
+                    if (newp == NULL) {
+                        malloc_error(tracenum, opnum, "mm_realloc failed.");
+                        goto out;
+                    }
+                    if (ranges != NULL) {
+                        if (e != NULL)
+                            remove_range(ranges, e->p);
+                        if (add_range(ranges, newp, size, tracenum, opnum) == 0)
+                            goto out;
+                        for (j = 0; j < oldsize && j < size; j++) {
+                            if (newp[j] != (char) ((op->index & 0xFF) | 0xAA)) {
+                                malloc_error(tracenum, opnum, "mm_realloc did not preserve the "
+                                                              "data from old block");
+                                goto out;
+                            }
+                        }
+                        memset(newp, (op->index & 0xFF) | 0xAA, size);
+                    }
+                    if (e != NULL) {
+                        e->p = newp;
+                        e->size = size;
+                    } else {
+                        add_id(&ids, op->index, newp, size);
+                    }
+                    total_size += size - oldsize;
+                    break;
+
+                case FREE: /* mm_free */
+                    if ((e = find_id(&ids, op->index)) == NULL) {
+                        malloc_error(tracenum, opnum, "free of an id that is not allocated.");
+                        goto out;
+                    }
+                    if (ranges != NULL)
+                        remove_range(ranges, e->p);
+                    mm_free(e->p);
+                    total_size -= e->size;
+                    remove_id(&ids, e);
+                    break;
+
+                case ALLOC_BATCH: /* mm_malloc_batch */
+                case FREE_BATCH: /* mm_free_batch */
+                    if (OP_COUNT(op) > batch_len) {
+                        batch_len = OP_COUNT(op);
+                        if ((batch = (char **) realloc(batch, batch_len * sizeof(char *))) == NULL)
+                            unix_error("realloc error in replay_stream");
+                    }
+                    if (op->type == FREE_BATCH) {
+                        for (j = 0; j < OP_COUNT(op); j++) {
+                            if ((e = find_id(&ids, op->index + j)) == NULL) {
+                                malloc_error(tracenum, opnum, "free of an id that is not allocated.");
+                                goto out;
+                            }
+                            if (ranges != NULL)
+                                remove_range(ranges, e->p);
+                            batch[j] = e->p;
+                            total_size -= e->size;
+                            remove_id(&ids, e);
+                        }
+                        mm_free_batch((void **) batch, OP_COUNT(op));
+                        break;
+                    }
+                    if (mm_malloc_batch(size, OP_COUNT(op), (void **) batch) != (size_t) OP_COUNT(op)) {
+                        malloc_error(tracenum, opnum, "mm_malloc_batch failed.");
+                        goto out;
+                    }
+                    for (j = 0; j < OP_COUNT(op); j++) {
+                        if (find_id(&ids, op->index + j) != NULL) {
+                            malloc_error(tracenum, opnum, "id allocated again before it was freed.");
+                            goto out;
+                        }
+                        if (ranges != NULL &&
+                            !check_new_block(ranges, op, op->index + j, batch[j], tracenum, opnum))
+                            goto out;
+                        add_id(&ids, op->index + j, batch[j], size);
+                    }
+                    total_size += (long) size * OP_COUNT(op);
+                    break;
+
+                default:
+                    app_error("Nonexistent request type in replay_stream");
+            }
+            max_total_size = (total_size > max_total_size) ? total_size : max_total_size;
+        }
+    }
+    valid = 1;
+
+out:
+    close_stream(&stream);
+    free(ids.slots);
+    free(batch);
+    *ops = done;
+    *util = (double) max_total_size / (double) mem_peak_footprint();
+    return valid;
+}
+
+/*
+ * check_new_block - Checks block p that op just allocated for request 
+ *     id the way eval_mm_valid does, adds it to the range tree and 
+ *     fills it with the low byte of id.
+ */
+static int check_new_block(range_t **ranges, traceop_t *op, int id, char *p,
+                           int tracenum, int opnum) {
+    int j;
+
+    if (op->type == CALLOC) {
+        for (j = 0; j < op->size; j++) {
+            if (p[j] != 0) {
+                malloc_error(tracenum, opnum, "mm_calloc returned a block that is not zeroed.");
+                return 0;
+            }
+        }
+    }
+    if (op->type == MEMALIGN && (uintptr_t) p % OP_ALIGNMENT(op) != 0) {
+        malloc_error(tracenum, opnum, "mm_memalign returned a misaligned block.");
+        return 0;
+    }
+    if (add_range(ranges, p, op->size, tracenum, opnum) == 0)
+        return 0;
+    memset(p, (id & 0xFF) | 0xAA, op->size);
+    return 1;
+}
+
+/*
+ * resize_block - Resizes a block like mm_realloc. With -x, it first tries
+ *    to grow it in place the way a growable container would, and only
+ *    calls mm_realloc when the block would have to move.
+ */
+static char *resize_block(char *oldp, int size) {
+    if (try_expand && mm_try_expand(oldp, size) == 0) {
+        __atomic_fetch_add(&expanded, 1, __ATOMIC_RELAXED);
+        return oldp;
+    }
+    return mm_realloc(oldp, size);
+}
+
+/*
+ * sum_arena_stats - Adds up the counters of all arenas since mm_init
+ */
+static void sum_arena_stats(ArenaStats *total) {
+    int i;
+    ArenaStats stats;
+
+    memset(total, 0, sizeof(ArenaStats));
+    for (i = 0; i < mm_num_arenas(); i++) {
+        mm_arena_stats(i, &stats);
+        total->sbrks += stats.sbrks;
+        total->zeroCleared += stats.zeroCleared;
+        total->zeroSkipped += stats.zeroSkipped;
+    }
+}
+
+/*
+ * record_heap_stats - Records what the heap looks like after the 
+ *    utilization run of trace tracenum.
+ */
+static void record_heap_stats(stats_t *stats, int tracenum) {
+    ArenaStats arena_stats;
+
+    stats->footprint = mem_heapsize() + mem_mapsize();
+    stats->mapped = mem_peak_mapsize();
+    stats->committed = mem_committed();
+    sum_arena_stats(&arena_stats);
+    stats->sbrks = arena_stats.sbrks;
+    if (verbose && arena_stats.zeroCleared + arena_stats.zeroSkipped > 0)
+        printf("trace %d calloc: %lu KB cleared, %lu KB known to be zero\n", tracenum,
+               (unsigned long) arena_stats.zeroCleared / 1024,
+               (unsigned long) arena_stats.zeroSkipped / 1024);
+}
+
+/*
+ * eval_mm_parallel - Replays the trace in nthreads threads at the same
+ *    time, each with its own copy of the blocks, and prints how the
+ *    work was spread over the arenas of the mm package. An arena's 
+ *    ops are the requests its own counters say it served, whichever 
+ *    thread made them, since threads move to another arena when theirs
+ *    is busy. Its throughput is those ops over the time of the whole 
+ *    run, so the arenas add up to the total.
+ */
+static void eval_mm_parallel(trace_t *trace, int tracenum, int nthreads) {
+    int i, failed = 0;
+    double secs, ops;
+    pthread_t *threads;
+    replay_t *replays;
+    ArenaStats stats;
+    struct timeval start, end;
+
+    threads = (pthread_t *) malloc(nthreads * sizeof(pthread_t));
+    replays = (replay_t *) calloc(nthreads, sizeof(replay_t));
+    if (threads == NULL || replays == NULL)
+        unix_error("malloc failed in eval_mm_parallel");
+
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (mm_init() < 0)
+        app_error("mm_init failed in eval_mm_parallel");
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < nthreads; i++) {
+        replays[i].trace = trace;
+        if ((replays[i].blocks = calloc(trace->num_ids, sizeof(char *))) == NULL)
+            unix_error("calloc failed in eval_mm_parallel");
+        if (pthread_create(&threads[i], NULL, replay_mm_thread, &replays[i]) != 0)
+            unix_error("pthread_create failed in eval_mm_parallel");
+    }
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+        failed += replays[i].failed;
+        free(replays[i].blocks);
+    }
+    gettimeofday(&end, NULL);
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+
+    printf("trace %d in %d threads: %s, %.0f Kops\n", tracenum, nthreads,
+           failed ? "out of memory" : "ok",
+           (double) trace->num_ops * nthreads / 1e3 / secs);
+    printf("%6s%10s%10s%10s%10s%10s%10s\n", "arena", "ops", "Kops", "cached", "contended", "heap", "purged");
+    for (i = 0; i < mm_num_arenas(); i++) {
+        mm_arena_stats(i, &stats);
+        ops = stats.mallocs + stats.frees + stats.reallocs + stats.cacheHits;
+        printf("%6d%10.0f%10.0f", i, ops, ops / 1e3 / secs);
+        printf("%10lu%10lu%10lu%10lu\n", stats.cacheHits, stats.contended,
+               (unsigned long) stats.heapSize, (unsigned long) stats.purged);
+    }
+
+    free(threads);
+    free(replays);
+}
+
+/*
+ * replay_mm_thread - One thread of eval_mm_parallel, stops at the first
+ *    request the mm package can't satisfy.
+ */
+static void *replay_mm_thread(void *ptr) {
+    int i, index, count;
+    char *p;
+    replay_t *replay = (replay_t *) ptr;
+    trace_t *trace = replay->trace;
+
+    for (i = 0; i < trace->num_ops; i++) {
+        index = trace->ops[i].index;
+        switch (trace->ops[i].type) {
+
+            case ALLOC: /* mm_malloc */
+                p = mm_malloc(trace->ops[i].size);
+                break;
+
+            case REALLOC: /* mm_realloc */
+                p = resize_block(replay->blocks[index], trace->ops[i].size);
+                break;
+
+            case FREE: /* mm_free */
+                mm_free(replay->blocks[index]);
+                replay->blocks[index] = NULL;
+                continue;
+
+            case MEMALIGN: /* mm_memalign */
+                p = mm_memalign(OP_ALIGNMENT(&trace->ops[i]), trace->ops[i].size);
+                break;
+
+            case CALLOC: /* mm_calloc */
+                p = mm_calloc(1, trace->ops[i].size);
+                break;
+
+            case ALLOC_BATCH: /* mm_malloc_batch */
+                count = OP_COUNT(&trace->ops[i]);
+                if (mm_malloc_batch(trace->ops[i].size, count,
+                                    (void **) &replay->blocks[index]) == (size_t) count)
+                    continue;
+                p = NULL;
+                break;
+
+            case FREE_BATCH: /* mm_free_batch */
+                count = OP_COUNT(&trace->ops[i]);
+                mm_free_batch((void **) &replay->blocks[index], count);
+                memset(&replay->blocks[index], 0, count * sizeof(char *));
+                continue;
+
+            default:
+                app_error("Nonexistent request type in replay_mm_thread");
+                return NULL;
+        }
+        if (p == NULL) {
+            replay->failed = 1;
+            break;
+        }
+        replay->blocks[index] = p;
+    }
+
+    /* Hand back whatever a failed replay still holds */
+    for (i = 0; i < trace->num_ids; i++)
+        mm_free(replay->blocks[i]);
+    return NULL;
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -822,7 +2034,7 @@ static void eval_mm_speed(void *ptr) {
  *
  */
 static int eval_libc_valid(trace_t *trace, int tracenum) {
-    int i, newsize;
+    int i, j, newsize;
     char *p, *newp, *oldp;
 
     for (i = 0; i < trace->num_ops; i++) {
@@ -850,6 +2062,37 @@ static int eval_libc_valid(trace_t *trace, int tracenum) {
                 free(trace->blocks[trace->ops[i].index]);
                 break;
 
+            case MEMALIGN: /* posix_memalign */
+                if (posix_memalign((void **) &p, OP_ALIGNMENT(&trace->ops[i]), trace->ops[i].size) != 0) {
+                    malloc_error(tracenum, i, "libc posix_memalign failed");
+                    unix_error("System message");
+                }
+                trace->blocks[trace->ops[i].index] = p;
+                break;
+
+            case CALLOC: /* calloc */
+                if ((p = calloc(1, trace->ops[i].size)) == NULL) {
+                    malloc_error(tracenum, i, "libc calloc failed");
+                    unix_error("System message");
+                }
+                trace->blocks[trace->ops[i].index] = p;
+                break;
+
+            case ALLOC_BATCH: /* one malloc per block */
+                for (j = 0; j < OP_COUNT(&trace->ops[i]); j++) {
+                    if ((p = malloc(trace->ops[i].size)) == NULL) {
+                        malloc_error(tracenum, i, "libc malloc failed");
+                        unix_error("System message");
+                    }
+                    trace->blocks[trace->ops[i].index + j] = p;
+                }
+                break;
+
+            case FREE_BATCH: /* one free per block */
+                for (j = 0; j < OP_COUNT(&trace->ops[i]); j++)
+                    free(trace->blocks[trace->ops[i].index + j]);
+                break;
+
             default:
                 app_error("invalid operation type  in eval_libc_valid");
         }
@@ -864,7 +2107,7 @@ static int eval_libc_valid(trace_t *trace, int tracenum) {
  *    of traces.
  */
 static void eval_libc_speed(void *ptr) {
-    int i;
+    int i, j;
     int index, size, newsize;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *) ptr)->trace;
@@ -894,6 +2137,33 @@ static void eval_libc_speed(void *ptr) {
                 block = trace->blocks[index];
                 free(block);
                 break;
+
+            case MEMALIGN: /* posix_memalign */
+                index = trace->ops[i].index;
+                if (posix_memalign((void **) &p, OP_ALIGNMENT(&trace->ops[i]), trace->ops[i].size) != 0)
+                    unix_error("posix_memalign failed in eval_libc_speed");
+                trace->blocks[index] = p;
+                break;
+
+            case CALLOC: /* calloc */
+                index = trace->ops[i].index;
+                if ((p = calloc(1, trace->ops[i].size)) == NULL)
+                    unix_error("calloc failed in eval_libc_speed");
+                trace->blocks[index] = p;
+                break;
+
+            case ALLOC_BATCH: /* one malloc per block */
+                index = trace->ops[i].index;
+                for (j = 0; j < OP_COUNT(&trace->ops[i]); j++)
+                    if ((trace->blocks[index + j] = malloc(trace->ops[i].size)) == NULL)
+                        unix_error("malloc failed in eval_libc_speed");
+                break;
+
+            case FREE_BATCH: /* one free per block */
+                index = trace->ops[i].index;
+                for (j = 0; j < OP_COUNT(&trace->ops[i]); j++)
+                    free(trace->blocks[index + j]);
+                break;
         }
     }
 }
@@ -918,47 +2188,71 @@ static void printresults(int n, stats_t *stats) {
     double secs = 0;
     double ops = 0;
     double util = 0;
+    double footprint = 0;
+    double mapped = 0;
+    double committed = 0;
+    double sbrks = 0;
 
     /* Print the individual results for each trace */
-    printf("%5s%7s %5s%8s%10s%6s\n",
-           "trace", " valid", "util", "ops", "secs", "Kops");
+    printf("%5s%7s %5s%8s%10s%6s%8s%8s%8s%7s\n",
+           "trace", " valid", "util", "ops", "secs", "Kops", "endKB", "mapKB", "comKB", "sbrks");
     for (i = 0; i < n; i++) {
         if (stats[i].valid) {
-            printf("%2d %10s %5.0f%% %8.0f %10.6f %6.0f\n",
+            printf("%2d %10s %5.0f%% %8.0f %10.6f %6.0f %7.0f %7.0f %7.0f %6.0f\n",
                    i,
                    "yes",
                    stats[i].util * 100.0,
                    stats[i].ops,
                    stats[i].secs,
-                   (stats[i].ops / 1e3) / stats[i].secs);
+                   (stats[i].ops / 1e3) / stats[i].secs,
+                   stats[i].footprint / 1024,
+                   stats[i].mapped / 1024,
+                   stats[i].committed / 1024,
+                   stats[i].sbrks);
             secs += stats[i].secs;
             ops += stats[i].ops;
             util += stats[i].util;
+            footprint += stats[i].footprint;
+            mapped += stats[i].mapped;
+            committed += stats[i].committed;
+            sbrks += stats[i].sbrks;
         } else {
-            printf("%2d %10s %6s %8s %10s %6s\n",
+            printf("%2d %10s %6s %8s %10s %6s %7s %7s %7s %6s\n",
                    i,
                    "no",
                    "-",
                    "-",
                    "-",
+                   "-",
+                   "-",
+                   "-",
+                   "-",
                    "-");
         }
     }
 
     /* Print the aggregate results for the set of traces */
     if (errors == 0) {
-        printf("%12s%5.0f%%%8.0f%10.6f%6.0f\n",
+        printf("%12s%5.0f%%%8.0f%10.6f%6.0f%8.0f%8.0f%8.0f%7.0f\n",
                "Total       ",
                (util / n) * 100.0,
                ops,
                secs,
-               (ops / 1e3) / secs);
+               (ops / 1e3) / secs,
+               footprint / 1024,
+               mapped / 1024,
+               committed / 1024,
+               sbrks);
     } else {
-        printf("%12s%6s%8s%10s%6s\n",
+        printf("%12s%6s%8s%10s%6s%8s%8s%8s%7s\n",
                "Total       ",
                "-",
                "-",
                "-",
+               "-",
+               "-",
+               "-",
+               "-",
                "-");
     }
 
@@ -992,13 +2286,28 @@ void malloc_error(int tracenum, int opnum, char *msg) {
  * usage - Explain the command line arguments
  */
 static void usage(void) {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvValsx] [-f <file>] [-t <dir>] [-w <file>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-m <MB>    Size of the simulated heap (default %d MB).\n", MAX_HEAP >> 20);
+    fprintf(stderr, "\t-p <n>     Also replay each trace in <n> threads at once.\n");
+    fprintf(stderr, "\t-s         Stream the traces instead of loading them (not with -l or -p).\n");
+    fprintf(stderr, "\t-x         Try mm_try_expand before every mm_realloc.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
+    fprintf(stderr, "\t-w <file>  Write the -f trace to <file> in binary form and exit.\n");
+    fprintf(stderr, "Environment\n");
+    fprintf(stderr, "\tMM_POLICY  Placement policy: first, next, best or best<N>.\n");
+    fprintf(stderr, "\tMM_ARENAS  Number of arenas the heap is split into (1-%d).\n", MEM_MAX_REGIONS);
+    fprintf(stderr, "\tMM_TRIM_THRESHOLD  Free bytes at the end of an arena that get trimmed (0 = never).\n");
+    fprintf(stderr, "\tMM_MMAP_THRESHOLD  Requests this large get a mapping of their own (0 = never).\n");
+    fprintf(stderr, "\tMM_PURGE_THRESHOLD Free blocks this large give their pages back (0 = never).\n");
+    fprintf(stderr, "\tMM_PURGE_DECAY     Frees between purges (0 = right away).\n");
+    fprintf(stderr, "\tMM_GROWTH  Heap growth chunk: fixed, geometric or demand.\n");
+    fprintf(stderr, "\tMM_GROW_MAX        Largest growth chunk for geometric and demand.\n");
+    fprintf(stderr, "\tMM_DEFER_COALESCE  1 = keep small frees on quick lists, coalesce in bulk.\n");
 }
@@ -3,35 +3,106 @@
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
  */
+#define _GNU_SOURCE /* mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <sys/mman.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "memlib.h"
 #include "config.h"
 
 /* private variables */
 static char *mem_start_brk;  /* points to first byte of heap */
-static char *mem_brk;        /* points to last byte of heap */
 static char *mem_max_addr;   /* largest legal heap address */ 
+static size_t mem_max_heap;  /* bytes the heap can grow to */
 
 /* 
- * mem_init - initialize the memory system model
+ * The heap is split into mem_nregions regions of mem_region_span bytes,
+ * each with its own brk. Region 0 starts at mem_start_brk and is the
+ * one mem_sbrk extends.
+ */
+static int mem_nregions;
+static size_t mem_region_span;
+static char *mem_region_brk[MEM_MAX_REGIONS]; /* brk of each region */
+static char *mem_region_commit[MEM_MAX_REGIONS]; /* end of the committed pages of each region */
+static char *mem_region_zeroed[MEM_MAX_REGIONS]; /* each region reads as zero from here on */
+
+/* 
+ * Large blocks can also live in mappings of their own outside the heap.
+ * The live ones are hashed by their first page, so a mapping is found in
+ * constant time when it is unmapped or resized, or when the driver
+ * checks a payload against it. They count towards the footprint.
+ */
+typedef struct mem_map_t {
+    char *lo;                  /* first byte of the mapping */
+    size_t size;               /* bytes mapped, a multiple of the page size */
+    struct mem_map_t *next;    /* next mapping in the same chain */
+} mem_map_t;
+
+#define MEM_MAP_BUCKETS 512    /* chains in the first table, it doubles as needed */
+
+static mem_map_t **mem_map_table; /* chains of live mappings */
+static size_t mem_map_buckets;  /* number of chains, a power of two */
+static size_t mem_nmaps;        /* live mappings */
+static mem_map_t *mem_spare_maps; /* records to reuse, linked through next */
+static size_t mem_mapped;       /* bytes in live mappings */
+static size_t mem_peak;         /* largest mem_heapsize since the last reset */
+static size_t mem_peak_mapped;  /* largest mem_mapsize since the last reset */
+static size_t mem_peak_total;   /* largest sum of both since the last reset */
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER; /* guards the above */
+
+static mem_map_t *mem_new_map(void);
+static void mem_free_map(mem_map_t *map);
+static int mem_add_map(mem_map_t *map);
+static mem_map_t **mem_find_map(void *addr);
+static int mem_commit(int region, char *brk);
+static void mem_decommit(int region, char *brk);
+static void mem_update_peak(void);
+
+/* 
+ * mem_init - initialize the memory system model with a heap of MAX_HEAP
+ *    bytes
  */
 void mem_init(void)
 {
-    /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
+    mem_init_size(MAX_HEAP);
+}
+
+/* 
+ * mem_init_size - initialize the memory system model with a heap of
+ *    max_heap bytes
+ */
+void mem_init_size(size_t max_heap)
+{
+#if MEM_RESERVE
+    /* reserve the address space, pages are committed by mem_commit */
+    mem_start_brk = (char *)mmap(NULL, max_heap, PROT_NONE,
+				 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem_start_brk == MAP_FAILED) {
+	fprintf(stderr, "mem_init_vm: mmap error\n");
+	exit(1);
+    }
+#else
+    /* allocate the storage we will use to model the available VM, zeroed like fresh pages */
+    if ((mem_start_brk = (char *)calloc(1, max_heap)) == NULL) {
 	fprintf(stderr, "mem_init_vm: malloc error\n");
 	exit(1);
     }
+#endif
 
-    mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
-    mem_brk = mem_start_brk;                  /* heap is empty initially */
+    mem_max_heap = max_heap;
+    mem_max_addr = mem_start_brk + max_heap;  /* max legal heap address */
+    mem_nregions = 1;
+    mem_region_span = max_heap;
+    mem_region_brk[0] = mem_start_brk;        /* heap is empty initially */
+    mem_region_commit[0] = mem_start_brk;     /* and nothing is committed */
+    mem_region_zeroed[0] = mem_start_brk;     /* or written to */
 }
 
 /* 
@@ -39,7 +110,11 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
+#if MEM_RESERVE
+    munmap(mem_start_brk, mem_max_heap);
+#else
     free(mem_start_brk);
+#endif
 }
 
 /*
@@ -47,27 +122,500 @@ void mem_deinit(void)
  */
 void mem_reset_brk()
 {
-    mem_brk = mem_start_brk;
+    int i;
+    size_t b;
+    mem_map_t *map;
+
+    for (i = 0; i < mem_nregions; i++)
+	mem_region_brk[i] = mem_start_brk + i * mem_region_span;
+
+    /* mappings left over from the last run go away with the heap */
+    pthread_mutex_lock(&mem_lock);
+    for (b = 0; b < mem_map_buckets; b++) {
+	while ((map = mem_map_table[b]) != NULL) {
+	    mem_map_table[b] = map->next;
+	    munmap(map->lo, map->size);
+	    mem_free_map(map);
+	}
+    }
+    mem_nmaps = 0;
+    pthread_mutex_unlock(&mem_lock);
+    mem_mapped = 0;
+    mem_peak = 0;
+    mem_peak_mapped = 0;
+    mem_peak_total = 0;
+}
+
+/*
+ * mem_set_regions - split the heap into n equally sized, page aligned 
+ *    regions with their own brk, and empty all of them. Returns -1 if
+ *    n is out of range.
+ */
+int mem_set_regions(int n)
+{
+    int i;
+
+    if (n < 1 || n > MEM_MAX_REGIONS)
+	return -1;
+
+    /* the committed pages of the old regions don't line up with the new ones */
+    if (n != mem_nregions) {
+	for (i = 0; i < mem_nregions; i++)
+	    mem_decommit(i, mem_start_brk + i * mem_region_span);
+	mem_nregions = n;
+	mem_region_span = (mem_max_heap / n) & ~(mem_pagesize() - 1);
+	for (i = 0; i < n; i++)
+	    mem_region_commit[i] = mem_region_zeroed[i] = mem_start_brk + i * mem_region_span;
+    }
+    mem_reset_brk();
+    return 0;
+}
+
+/*
+ * mem_num_regions - returns the number of regions the heap is split into
+ */
+int mem_num_regions()
+{
+    return mem_nregions;
+}
+
+/*
+ * mem_purge - give the whole pages in [lo, hi) back to the OS while 
+ *    they stay part of the heap. They read as zero afterwards. Returns
+ *    the number of bytes given back.
+ */
+size_t mem_purge(void *lo, void *hi)
+{
+    uintptr_t mask = mem_pagesize() - 1;
+    char *first = (char *)(((uintptr_t)lo + mask) & ~mask);
+    char *last = (char *)((uintptr_t)hi & ~mask);
+
+    if (first >= last || madvise(first, last - first, MADV_DONTNEED) < 0)
+	return 0;
+    return (size_t)(last - first);
+}
+
+/*
+ * mem_reset_commit - give back every committed page above the brk of
+ *    each region. mem_reset_brk keeps them, like a process that reuses
+ *    its heap, which is much cheaper when the heap is reset often.
+ */
+void mem_reset_commit()
+{
+    int i;
+
+    for (i = 0; i < mem_nregions; i++)
+	mem_decommit(i, mem_region_brk[i]);
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area. A
+ *    negative incr shrinks the heap and returns the old brk.
  */
-void *mem_sbrk(int incr) 
+void *mem_sbrk(intptr_t incr) 
 {
-    char *old_brk = mem_brk;
+    void *p = mem_region_sbrk(0, incr);
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
-	errno = ENOMEM;
+    if (p == (void *)-1)
 	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
+    return p;
+}
+
+/*
+ * mem_region_sbrk - mem_sbrk for one region of the heap. A full region
+ *    is an expected condition for callers with several regions, so it
+ *    only sets errno. A negative incr shrinks the region, and the whole
+ *    pages that are given back are released to the OS.
+ */
+void *mem_region_sbrk(int region, intptr_t incr)
+{
+    char *old_brk = mem_region_brk[region];
+    char *region_start = mem_start_brk + region * mem_region_span;
+    char *region_end = region_start + mem_region_span;
+
+    if (incr > region_end - old_brk || incr < region_start - old_brk ||
+	mem_commit(region, old_brk + incr) < 0) {
+	errno = ENOMEM;
 	return (void *)-1;
     }
-    mem_brk += incr;
+    mem_region_brk[region] += incr;
+
+    if (incr < 0) {
+	mem_decommit(region, old_brk + incr);
+    } else {
+	/* the caller may write anything up to the new brk */
+	if (mem_region_zeroed[region] < mem_region_brk[region])
+	    mem_region_zeroed[region] = mem_region_brk[region];
+	mem_update_peak();
+    }
     return (void *)old_brk;
 }
 
+/*
+ * mem_region_zero - returns the address from which a region reads as
+ *    zero. Pages above the brk that were given back or never handed
+ *    out are zero, so an sbrk that starts at or above it returns
+ *    zeroed memory.
+ */
+void *mem_region_zero(int region)
+{
+    return (void *)mem_region_zeroed[region];
+}
+
+/*
+ * mem_update_peak - called whenever the heap or the mappings grew
+ */
+static void mem_update_peak(void)
+{
+    size_t heapsize;
+
+    pthread_mutex_lock(&mem_lock);
+    heapsize = mem_heapsize();
+    if (heapsize > mem_peak)
+	mem_peak = heapsize;
+    if (mem_mapped > mem_peak_mapped)
+	mem_peak_mapped = mem_mapped;
+    if (heapsize + mem_mapped > mem_peak_total)
+	mem_peak_total = heapsize + mem_mapped;
+    pthread_mutex_unlock(&mem_lock);
+}
+
+/*
+ * mem_mmap - map size bytes, rounded up to whole pages, outside the
+ *    heap. Returns (void *)-1 on failure like mem_sbrk.
+ */
+void *mem_mmap(size_t size)
+{
+    mem_map_t *map;
+    char *p;
+
+    size = (size + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+	return (void *)-1;
+
+    pthread_mutex_lock(&mem_lock);
+    if ((map = mem_new_map()) == NULL) {
+	pthread_mutex_unlock(&mem_lock);
+	munmap(p, size);
+	return (void *)-1;
+    }
+    map->lo = p;
+    map->size = size;
+    if (mem_add_map(map) < 0) {
+	mem_free_map(map);
+	pthread_mutex_unlock(&mem_lock);
+	munmap(p, size);
+	return (void *)-1;
+    }
+    mem_mapped += size;
+    pthread_mutex_unlock(&mem_lock);
+
+    mem_update_peak();
+    return (void *)p;
+}
+
+/*
+ * mem_new_map - returns a record for a new mapping, caller holds
+ *    mem_lock. Records come from pages of their own rather than from
+ *    malloc, which may be the mm package itself (see preload.c).
+ */
+static mem_map_t *mem_new_map(void)
+{
+    mem_map_t *map;
+    size_t i, n;
+
+    if (mem_spare_maps == NULL) {
+	map = mmap(NULL, mem_pagesize(), PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+	    return NULL;
+	n = mem_pagesize() / sizeof(mem_map_t);
+	for (i = 0; i < n; i++)
+	    mem_free_map(&map[i]);
+    }
+    map = mem_spare_maps;
+    mem_spare_maps = map->next;
+    return map;
+}
+
+/*
+ * mem_free_map - keeps a record for reuse, caller holds mem_lock
+ */
+static void mem_free_map(mem_map_t *map)
+{
+    map->next = mem_spare_maps;
+    mem_spare_maps = map;
+}
+
+/*
+ * mem_map_chain - returns the chain a mapping starting at lo is on,
+ *    caller holds mem_lock
+ */
+static mem_map_t **mem_map_chain(char *lo)
+{
+    uint64_t page = (uintptr_t)lo / mem_pagesize();
+
+    return &mem_map_table[(size_t)((page * 0x9E3779B97F4A7C15ULL) >> 32) & (mem_map_buckets - 1)];
+}
+
+/*
+ * mem_add_map - puts a record on its chain, doubling the table once 
+ *    there are as many mappings as chains. Like the records, the table 
+ *    lives in pages of its own. Returns -1 if there is no room for it,
+ *    caller holds mem_lock.
+ */
+static int mem_add_map(mem_map_t *map)
+{
+    mem_map_t **old_table = mem_map_table, **chain, *next;
+    size_t old_buckets = mem_map_buckets;
+    size_t b, n;
+
+    if (mem_nmaps >= mem_map_buckets) {
+	n = old_buckets ? 2 * old_buckets : MEM_MAP_BUCKETS;
+	chain = mmap(NULL, n * sizeof(mem_map_t *), PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (chain == MAP_FAILED)
+	    return -1;
+	mem_map_table = chain;
+	mem_map_buckets = n;
+	for (b = 0; b < old_buckets; b++) {
+	    for (next = old_table[b]; next != NULL;) {
+		mem_map_t *m = next;
+		next = m->next;
+		chain = mem_map_chain(m->lo);
+		m->next = *chain;
+		*chain = m;
+	    }
+	}
+	if (old_table != NULL)
+	    munmap(old_table, old_buckets * sizeof(mem_map_t *));
+    }
+
+    chain = mem_map_chain(map->lo);
+    map->next = *chain;
+    *chain = map;
+    mem_nmaps++;
+    return 0;
+}
+
+/*
+ * mem_find_map - returns the link pointing to the mapping starting at
+ *    addr, caller holds mem_lock
+ */
+static mem_map_t **mem_find_map(void *addr)
+{
+    mem_map_t **link;
+
+    if (mem_map_table == NULL)
+	return NULL;
+    for (link = mem_map_chain((char *)addr); *link != NULL; link = &(*link)->next)
+	if ((*link)->lo == (char *)addr)
+	    return link;
+    return NULL;
+}
+
+/*
+ * mem_munmap - unmap a mapping returned by mem_mmap or mem_mremap
+ */
+int mem_munmap(void *addr)
+{
+    mem_map_t **link, *map;
+    char *lo;
+    size_t size;
+
+    pthread_mutex_lock(&mem_lock);
+    if ((link = mem_find_map(addr)) == NULL) {
+	pthread_mutex_unlock(&mem_lock);
+	errno = EINVAL;
+	return -1;
+    }
+    map = *link;
+    *link = map->next;
+    mem_nmaps--;
+    mem_mapped -= map->size;
+    lo = map->lo;
+    size = map->size;
+    mem_free_map(map);
+    pthread_mutex_unlock(&mem_lock);
+
+    munmap(lo, size);
+    return 0;
+}
+
+/*
+ * mem_mremap - resize a mapping to size bytes, rounded up to whole
+ *    pages. It may move, the new address is returned, or (void *)-1.
+ */
+void *mem_mremap(void *addr, size_t size)
+{
+    mem_map_t **link, *map;
+    char *p;
+
+    size = (size + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+
+    pthread_mutex_lock(&mem_lock);
+    if ((link = mem_find_map(addr)) == NULL) {
+	pthread_mutex_unlock(&mem_lock);
+	errno = EINVAL;
+	return (void *)-1;
+    }
+    map = *link;
+    p = mremap(map->lo, map->size, size, MREMAP_MAYMOVE);
+    if (p == MAP_FAILED) {
+	pthread_mutex_unlock(&mem_lock);
+	return (void *)-1;
+    }
+    mem_mapped += size - map->size;
+    map->size = size;
+
+    /* a mapping that moved is hashed under its new first page */
+    if (p != map->lo) {
+	*link = map->next;
+	map->lo = p;
+	link = mem_map_chain(p);
+	map->next = *link;
+	*link = map;
+    }
+    pthread_mutex_unlock(&mem_lock);
+
+    mem_update_peak();
+    return (void *)p;
+}
+
+/*
+ * mem_is_mapped - returns 1 if [lo, hi] lies within a live mapping that
+ *    starts on the page of lo. The payload of a mapped block always 
+ *    starts on the first page of its mapping, which makes this a single
+ *    lookup.
+ */
+int mem_is_mapped(void *lo, void *hi)
+{
+    mem_map_t **link;
+    int found;
+
+    pthread_mutex_lock(&mem_lock);
+    link = mem_find_map((void *)((uintptr_t)lo & ~(mem_pagesize() - 1)));
+    found = link != NULL && (char *)hi < (*link)->lo + (*link)->size;
+    pthread_mutex_unlock(&mem_lock);
+    return found;
+}
+
+/*
+ * mem_is_heap - returns 1 if addr lies in the simulated heap
+ */
+int mem_is_heap(void *addr)
+{
+    return (char *)addr >= mem_start_brk && (char *)addr < mem_max_addr;
+}
+
+/*
+ * mem_mapsize - returns the number of bytes in live mappings
+ */
+size_t mem_mapsize()
+{
+    return mem_mapped;
+}
+
+/*
+ * mem_fork_prepare, mem_fork_parent, mem_fork_child - pthread_atfork
+ *    handlers that keep a fork from leaving mem_lock held in the child
+ */
+void mem_fork_prepare()
+{
+    pthread_mutex_lock(&mem_lock);
+}
+
+void mem_fork_parent()
+{
+    pthread_mutex_unlock(&mem_lock);
+}
+
+void mem_fork_child()
+{
+    pthread_mutex_unlock(&mem_lock);
+}
+
+/*
+ * mem_commit - make sure the pages of a region up to brk are committed.
+ *    The malloc backend has nothing to do but count them.
+ */
+static int mem_commit(int region, char *brk)
+{
+    char *commit = mem_region_commit[region];
+    char *region_end = mem_start_brk + (region + 1) * mem_region_span;
+    char *end;
+
+    if (brk <= commit)
+	return 0;
+
+    end = (char *)(((uintptr_t)brk + MEM_COMMIT_CHUNK - 1) & ~((uintptr_t)MEM_COMMIT_CHUNK - 1));
+    if (end > region_end)
+	end = region_end;
+#if MEM_RESERVE
+    if (mprotect(commit, end - commit, PROT_READ | PROT_WRITE) < 0)
+	return -1;
+#endif
+    mem_region_commit[region] = end;
+    return 0;
+}
+
+/*
+ * mem_decommit - give the whole pages of a region above brk back to
+ *    the OS. The heap need not start on a page, so the last page of a
+ *    region may be shared with the next one and is kept.
+ */
+static void mem_decommit(int region, char *brk)
+{
+    uintptr_t mask = mem_pagesize() - 1;
+    char *first = (char *)(((uintptr_t)brk + mask) & ~mask);
+    char *last = (char *)((uintptr_t)mem_region_commit[region] & ~mask);
+
+    if (first >= last)
+	return;
+    madvise(first, last - first, MADV_DONTNEED);
+#if MEM_RESERVE
+    mprotect(first, last - first, PROT_NONE);
+#endif
+    mem_region_commit[region] = first;
+    /* a kept page still holds whatever was written to it */
+    if (mem_region_zeroed[region] > first && mem_region_zeroed[region] <= last)
+	mem_region_zeroed[region] = first;
+}
+
+/*
+ * mem_region_size - returns the most bytes a region can grow to
+ */
+size_t mem_region_size()
+{
+    return mem_region_span;
+}
+
+/*
+ * mem_region_lo - return address of the first byte of a region
+ */
+void *mem_region_lo(int region)
+{
+    return (void *)(mem_start_brk + region * mem_region_span);
+}
+
+/*
+ * mem_region_hi - return address of the last byte in use in a region
+ */
+void *mem_region_hi(int region)
+{
+    return (void *)(mem_region_brk[region] - 1);
+}
+
+/*
+ * mem_region_of - return the region an address of the heap lies in
+ */
+int mem_region_of(void *addr)
+{
+    return (int)(((char *)addr - mem_start_brk) / mem_region_span);
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -81,7 +629,14 @@ void *mem_heap_lo()
  */
 void *mem_heap_hi()
 {
-    return (void *)(mem_brk - 1);
+    char *hi = mem_region_brk[0] - 1;
+    int i;
+
+    /* the last byte in use in the highest region that isn't empty */
+    for (i = 1; i < mem_nregions; i++)
+	if (mem_region_brk[i] > mem_start_brk + i * mem_region_span)
+	    hi = mem_region_brk[i] - 1;
+    return (void *)hi;
 }
 
 /*
@@ -89,7 +644,60 @@ void *mem_heap_hi()
  */
 size_t mem_heapsize() 
 {
-    return (size_t)(mem_brk - mem_start_brk);
+    size_t size = 0;
+    int i;
+
+    for (i = 0; i < mem_nregions; i++)
+	size += (size_t)(mem_region_brk[i] - (mem_start_brk + i * mem_region_span));
+    return size;
+}
+
+/*
+ * mem_peak_heapsize - returns the largest heap size since the last
+ *    mem_reset_brk, mem_heapsize is the current one
+ */
+size_t mem_peak_heapsize()
+{
+    return mem_peak;
+}
+
+/*
+ * mem_peak_mapsize - returns the largest mem_mapsize since the last
+ *    mem_reset_brk
+ */
+size_t mem_peak_mapsize()
+{
+    return mem_peak_mapped;
+}
+
+/*
+ * mem_peak_footprint - returns the largest heap plus mapped bytes 
+ *    since the last mem_reset_brk
+ */
+size_t mem_peak_footprint()
+{
+    return mem_peak_total;
+}
+
+/*
+ * mem_committed - returns the number of heap bytes backed by memory
+ */
+size_t mem_committed()
+{
+    size_t size = 0;
+    int i;
+
+    for (i = 0; i < mem_nregions; i++)
+	size += (size_t)(mem_region_commit[i] - (mem_start_brk + i * mem_region_span));
+    return size;
+}
+
+/*
+ * mem_max_heapsize - returns the most bytes the heap can grow to
+ */
+size_t mem_max_heapsize()
+{
+    return mem_max_heap;
 }
 
 /*
@@ -1,12 +1,43 @@
 #include <unistd.h>
+#include <stdint.h>
 
+/* most regions the heap can be split into */
+#define MEM_MAX_REGIONS 64
 
 void mem_init(void);               
+void mem_init_size(size_t max_heap);
 void mem_deinit(void);
-void *mem_sbrk(int incr);
+void *mem_sbrk(intptr_t incr);
 void mem_reset_brk(void); 
+void mem_reset_commit(void);
+size_t mem_purge(void *lo, void *hi);
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_peak_heapsize(void);
+size_t mem_peak_mapsize(void);
+size_t mem_peak_footprint(void);
+size_t mem_max_heapsize(void);
+size_t mem_committed(void);
 size_t mem_pagesize(void);
 
+int mem_set_regions(int n);
+int mem_num_regions(void);
+size_t mem_region_size(void);
+void *mem_region_sbrk(int region, intptr_t incr);
+void *mem_region_lo(int region);
+void *mem_region_hi(int region);
+int mem_region_of(void *addr);
+void *mem_region_zero(int region);
+
+void *mem_mmap(size_t size);
+int mem_munmap(void *addr);
+void *mem_mremap(void *addr, size_t size);
+int mem_is_mapped(void *lo, void *hi);
+int mem_is_heap(void *addr);
+size_t mem_mapsize(void);
+
+void mem_fork_prepare(void);
+void mem_fork_parent(void);
+void mem_fork_child(void);
+
@@ -9,9 +9,12 @@
  * NOTE TO STUDENTS: Replace this header comment with your own header
  * comment that gives a high level description of your solution.
  */
+#define _GNU_SOURCE /* madvise and MAP_ANONYMOUS with -std=c99 */
 #include <stdio.h>
+#include <errno.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include "mm.h"
 #include "memlib.h"
 
@@ -22,150 +25,1170 @@
 #define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~0x7)
 
 #define SIZE_T_SIZE (ALIGN(sizeof(size_t)))
-#define BLOCK_METADATA_SIZE (sizeof(BlockMetaData) + sizeof(BlockData)) //32B
-#define MINIMUM_BLOCK_SIZE (BLOCK_METADATA_SIZE)
+//Allocated blocks only carry the header. Links and footer live in the payload of free blocks
+#define BLOCK_METADATA_SIZE (sizeof(BlockMetaData)) //8B
+#define MINIMUM_PAYLOAD_SIZE (2 * sizeof(BlockData *) + sizeof(BlockMetaData)) //24B
+#define MINIMUM_BLOCK_SIZE (BLOCK_METADATA_SIZE + MINIMUM_PAYLOAD_SIZE) //32B
 #define INITIAL_BLOCK_SIZE (1024)
-#define INITIAL_HEAP_SIZE (sizeof(HeapData))
+#define SLAB_HEADER_SIZE (ALIGN(sizeof(SlabPage)))
+//Larger requests can't be met. Below it, rounding up and adding headers, pages or an alignment can't wrap
+#define MAX_REQUEST_SIZE (SIZE_MAX / 4)
 
+//Bumped by mm_init, a thread cache from an older generation is stale
+static unsigned long heapGeneration = 0;
+static int numArenas = 1;
+static unsigned int nextArena = 0; //Round robin counter for threads picking an arena
+static size_t mmapThreshold = MMAP_THRESHOLD;
+static size_t minAlignment = ALIGNMENT; //Every block is aligned to this, see mm_set_alignment
 
+//Slab maps of the arenas, kept across mm_init
+static uint8_t *slabMaps[MEM_MAX_REGIONS];
+static size_t slabMapSizes[MEM_MAX_REGIONS];
+static __thread ThreadCache threadCache;
+static pthread_key_t cacheKey;
+static pthread_once_t cacheKeyOnce = PTHREAD_ONCE_INIT;
+
+
+/*
+ * mm_set_alignment - Makes every block mm_malloc, mm_calloc and mm_realloc hand out from now on
+ *     aligned to alignment, a power of two up to MAP_ALIGNMENT. Heap blocks then come from
+ *     heapMemalign instead of the slab pages, whose objects are only 8-byte aligned.
+ */
+int mm_set_alignment(size_t alignment) {
+    if (alignment < ALIGNMENT || alignment > MAP_ALIGNMENT || (alignment & (alignment - 1)) != 0) return -1;
+    minAlignment = alignment;
+    return 0;
+}
+
+/*
+ * mm_init - Sets up MM_ARENAS (default 1) arenas, each in its own region of the heap.
+ *     The memory system must already be initialized with mem_init.
+ */
 int mm_init(void) {
-    mem_init();
-    void *p = mem_sbrk(INITIAL_HEAP_SIZE);
-    void *b = mem_sbrk(INITIAL_BLOCK_SIZE + BLOCK_METADATA_SIZE);
+    const char *arenas = getenv("MM_ARENAS");
+
+    numArenas = arenas ? atoi(arenas) : 1;
+    if (numArenas < 1) numArenas = 1;
+    if (numArenas > MEM_MAX_REGIONS) numArenas = MEM_MAX_REGIONS;
+    if (mem_set_regions(numArenas) < 0) return -1;
+
+    mmapThreshold = readThreshold("MM_MMAP_THRESHOLD", MMAP_THRESHOLD);
+
+    for (int i = 0; i < numArenas; i++) {
+        if (initArena(i) < 0) return -1;
+    }
+
+    //Blocks sitting in thread caches belong to the previous heap
+    heapGeneration++;
+    nextArena = 0;
+
+    return 0;
+}
+
+//HeapData goes at the start of the arena's region, followed by the first free block
+int initArena(int arena) {
+    size_t slabMapSize = SLAB_MAP_SIZE(mem_region_size());
+    uint8_t *slabMap = getSlabMap(arena, slabMapSize);
+    bool isZero = mem_region_zero(arena) == mem_region_lo(arena);
+    void *p = mem_region_sbrk(arena, sizeof(HeapData));
+    void *b = mem_region_sbrk(arena, INITIAL_BLOCK_SIZE + BLOCK_METADATA_SIZE + BLOCK_METADATA_SIZE);
+    if (slabMap == NULL || p == (void *) -1 || b == (void *) -1) return -1;
 
     HeapData *hd = (HeapData *) p;
 
-    hd->firstFreeBlock = b;
+    //Clears the free lists, the tree, the slab classes and the stats
+    memset(hd, 0, sizeof(HeapData));
+    hd->slabMap = slabMap;
+    hd->slabMapSize = slabMapSize;
+    hd->arena = arena;
+    readPolicy(hd);
+    hd->trimThreshold = readThreshold("MM_TRIM_THRESHOLD", TRIM_THRESHOLD);
+    //A trimmed tail keeps TRIM_PAD bytes, so a smaller threshold would give back a negative amount
+    if (hd->trimThreshold > 0 && hd->trimThreshold < TRIM_PAD + MINIMUM_BLOCK_SIZE)
+        hd->trimThreshold = TRIM_PAD + MINIMUM_BLOCK_SIZE;
+    hd->purgeThreshold = readThreshold("MM_PURGE_THRESHOLD", PURGE_THRESHOLD);
+    hd->purgeDecay = readThreshold("MM_PURGE_DECAY", PURGE_DECAY);
+    hd->deferCoalesce = readThreshold("MM_DEFER_COALESCE", 0) != 0;
+    readGrowth(hd);
+    pthread_mutex_init(&hd->lock, NULL);
 
     BlockData *bd = (BlockData *) b;
-    bd->metaData.size = INITIAL_BLOCK_SIZE;
-    bd->metaData.isUsed = false;
-    bd->next = NULL;
-    bd->previous = NULL;
+    resetBlock(bd);
+    bd->metaData.isPurged = isZero;
+    setSize(&bd->metaData, INITIAL_BLOCK_SIZE);
 
     cloneToEnd(bd);
+    writeEpilogue(jumpToNext(bd), true);
+    insertFreeBlock(bd);
+
+    return 0;
+}
+
+//MM_POLICY is one of first, next, best or best<N> for the best of the first N fitting blocks
+void readPolicy(HeapData *hd) {
+    const char *policy = getenv("MM_POLICY");
+
+    hd->policy = FIRST_FIT;
+    hd->fitCandidates = 0;
+    if (policy == NULL) return;
+
+    if (strcmp(policy, "next") == 0) {
+        hd->policy = NEXT_FIT;
+    } else if (strcmp(policy, "best") == 0) {
+        hd->policy = BEST_FIT;
+    } else if (strncmp(policy, "best", 4) == 0 && atoi(policy + 4) > 0) {
+        hd->policy = BOUNDED_BEST_FIT;
+        hd->fitCandidates = atoi(policy + 4);
+    }
+}
+
+//MM_GROWTH is one of fixed, geometric or demand. MM_GROW_MAX caps the last two
+void readGrowth(HeapData *hd) {
+    const char *growth = getenv("MM_GROWTH");
+
+    hd->growth = GROW_FIXED;
+    if (growth && strcmp(growth, "geometric") == 0) hd->growth = GROW_GEOMETRIC;
+    else if (growth && strcmp(growth, "demand") == 0) hd->growth = GROW_DEMAND;
+
+    hd->growMax = ALIGN(readThreshold("MM_GROW_MAX", GROW_MAX_CHUNK));
+    if (hd->growMax < GROW_MIN_CHUNK) hd->growMax = GROW_MIN_CHUNK;
+    hd->growChunk = GROW_MIN_CHUNK;
+    hd->growDemand = 0;
+}
+
+//Size thresholds come from the environment, 0 turns the feature off
+size_t readThreshold(const char *name, size_t fallback) {
+    const char *threshold = getenv(name);
+
+    return threshold ? strtoul(threshold, NULL, 0) : fallback;
+}
+
+const char *mm_policy_name(void) {
+    static char name[32];
+    HeapData *hd = getArena(0);
+
+    switch (hd->policy) {
+        case NEXT_FIT:
+            return "next fit";
+        case BEST_FIT:
+            return "best fit";
+        case BOUNDED_BEST_FIT:
+            snprintf(name, sizeof(name), "best of first %d fit", hd->fitCandidates);
+            return name;
+        default:
+            return "first fit";
+    }
+}
+
+/*
+ * Thread caches - Every thread keeps a small LIFO stack of freed blocks per 8-byte size class.
+ *     Cached blocks stay marked as used in the heap, so mm_malloc and mm_free can hand them out
+ *     and take them back without the heap lock. A class that grows past CACHE_LIMIT gives
+ *     CACHE_FLUSH blocks back to the heap under a single lock.
+ */
+static ThreadCache *getThreadCache(void) {
+    if (threadCache.generation != heapGeneration) {
+        memset(&threadCache, 0, sizeof(ThreadCache));
+        threadCache.generation = heapGeneration;
+        threadCache.arena = (int) (__atomic_fetch_add(&nextArena, 1, __ATOMIC_RELAXED) % numArenas);
+    }
+    return &threadCache;
+}
+
+HeapData *getArena(int arena) {
+    return (HeapData *) mem_region_lo(arena);
+}
+
+BlockData *getFirstBlock(HeapData *hd) {
+    return (BlockData *) (hd + 1);
+}
+
+/*
+ * getSlabMap - Returns a cleared slab map for an arena. A map for a large heap can be large too,
+ *     so it lives in a mapping of its own outside the heap that only takes memory for the pages
+ *     that get touched.
+ */
+uint8_t *getSlabMap(int arena, size_t size) {
+    if (slabMapSizes[arena] == size) {
+        madvise(slabMaps[arena], size, MADV_DONTNEED);
+        return slabMaps[arena];
+    }
+
+    if (slabMaps[arena]) munmap(slabMaps[arena], slabMapSizes[arena]);
+    slabMaps[arena] = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (slabMaps[arena] == MAP_FAILED) {
+        slabMaps[arena] = NULL;
+        slabMapSizes[arena] = 0;
+        return NULL;
+    }
+    slabMapSizes[arena] = size;
+    return slabMaps[arena];
+}
+
+//Every block lives in the region of the arena that owns it
+HeapData *getHeap(void *ptr) {
+    return getArena(mem_region_of(ptr));
+}
+
+/*
+ * lockArena - Locks the arena of the calling thread. If it is busy, the thread moves to the
+ *     first other arena that is free, and only waits when all of them are taken.
+ */
+HeapData *lockArena(ThreadCache *cache) {
+    HeapData *hd;
+
+    for (int i = 0; i < numArenas; i++) {
+        int arena = (cache->arena + i) % numArenas;
+        hd = getArena(arena);
+        if (pthread_mutex_trylock(&hd->lock) == 0) {
+            if (i > 0) hd->contended++;
+            cache->arena = arena;
+            return hd;
+        }
+    }
+
+    hd = getArena(cache->arena);
+    pthread_mutex_lock(&hd->lock);
+    hd->contended++;
+    return hd;
+}
+
+int mm_num_arenas(void) {
+    return numArenas;
+}
+
+void mm_arena_stats(int arena, ArenaStats *stats) {
+    HeapData *hd = getArena(arena);
+
+    pthread_mutex_lock(&hd->lock);
+    stats->mallocs = hd->mallocs;
+    stats->frees = hd->frees;
+    stats->reallocs = hd->reallocs;
+    stats->cacheHits = hd->cacheHits;
+    stats->contended = hd->contended;
+    stats->trimmed = hd->trimmed;
+    stats->purges = hd->purges;
+    stats->purged = hd->purged;
+    stats->sbrks = hd->sbrks;
+    stats->zeroCleared = hd->zeroCleared;
+    stats->zeroSkipped = hd->zeroSkipped;
+    stats->heapSize = (size_t) ((char *) mem_region_hi(arena) + 1 - (char *) hd);
+    pthread_mutex_unlock(&hd->lock);
+}
+
+//Usable payload size of an allocated pointer. Reads only what the owner of ptr can change
+size_t getUsableSize(void *ptr) {
+    if (isMappedBlock(ptr)) return getSize(&getBlock(ptr)->metaData);
+
+    SlabPage *page = getSlabPage(ptr);
+    if (page) return page->objectSize;
+    return getSize(&getBlock(ptr)->metaData);
+}
+
+//Bytes the caller may use at ptr, at least what it asked for
+size_t mm_usable_size(void *ptr) {
+    if (ptr == NULL) return 0;
+    return getUsableSize(ptr);
+}
+
+/*
+ * mm_try_expand - Makes the block at ptr hold at least size bytes without moving it, by taking
+ *     a free successor or growing the heap behind the last block of an arena. Returns 0 when the
+ *     block is large enough now and -1 when it would have to move, in which case it is unchanged.
+ */
+int mm_try_expand(void *ptr, size_t size) {
+    if (ptr == NULL) return -1;
+    if (size <= getUsableSize(ptr)) return 0;
+
+    //Slab objects have a fixed size and mappings only grow by moving
+    if (isMappedBlock(ptr) || getSlabPage(ptr) || size > MAX_REQUEST_SIZE) return -1;
+
+    HeapData *hd = getHeap(ptr);
+    size_t newSize = ALIGN(size);
+    pthread_mutex_lock(&hd->lock);
+    bool grown = growBlock(getBlock(ptr), newSize);
+    hd->reallocs++;
+    pthread_mutex_unlock(&hd->lock);
+    return grown ? 0 : -1;
+}
+
+//Cached blocks can belong to any arena, so the lock is switched whenever the owner changes
+void flushCacheClass(ThreadCache *cache, int cacheClass, int count) {
+    HeapData *locked = NULL;
+
+    while (count-- > 0 && cache->objects[cacheClass] != NULL) {
+        void *obj = cache->objects[cacheClass];
+        HeapData *hd = getHeap(obj);
+
+        if (hd != locked) {
+            if (locked) pthread_mutex_unlock(&locked->lock);
+            pthread_mutex_lock(&hd->lock);
+            locked = hd;
+        }
+        cache->objects[cacheClass] = *(void **) obj;
+        cache->count[cacheClass]--;
+        heapFree(obj);
+    }
+    if (locked) pthread_mutex_unlock(&locked->lock);
+}
+
+//Thread exit hands the whole cache back to the heap
+static void destroyThreadCache(void *arg) {
+    ThreadCache *cache = (ThreadCache *) arg;
+    if (cache->generation != heapGeneration) return;
+
+    for (int i = 0; i < NUM_CACHE_CLASSES; i++) {
+        if (cache->objects[i]) flushCacheClass(cache, i, cache->count[i]);
+    }
+
+    HeapData *hd = lockArena(cache);
+    hd->cacheHits += cache->hits;
+    pthread_mutex_unlock(&hd->lock);
+}
+
+static void createCacheKey(void) {
+    pthread_key_create(&cacheKey, destroyThreadCache);
+}
+
+void *mm_malloc(size_t size) {
+    ThreadCache *cache = getThreadCache();
+    HeapData *hd;
+    void *p;
+
+    if (size > 0 && size <= CACHE_MAX_SIZE) {
+        int cacheClass = (int) (ALIGN(size) / ALIGNMENT) - 1;
+
+        p = cache->objects[cacheClass];
+        if (p) {
+            cache->objects[cacheClass] = *(void **) p;
+            cache->count[cacheClass]--;
+            cache->hits++;
+            return p;
+        }
+    }
+
+    if (mmapThreshold > 0 && size >= mmapThreshold) {
+        p = mapBlock(size);
+        if (p) return p;
+    }
+
+    hd = lockArena(cache);
+    p = heapMalloc(hd, size);
+    hd->mallocs++;
+    hd->cacheHits += cache->hits;
+    cache->hits = 0;
+    pthread_mutex_unlock(&hd->lock);
+
+    //An arena only owns its share of the heap, once it is full the others are tried
+    for (int i = 1; p == NULL && size > 0 && i < numArenas; i++) {
+        hd = getArena((cache->arena + i) % numArenas);
+        pthread_mutex_lock(&hd->lock);
+        p = heapMalloc(hd, size);
+        pthread_mutex_unlock(&hd->lock);
+    }
+    return p;
+}
+
+void mm_free(void *ptr) {
+    HeapData *hd;
+
+    if (ptr == NULL) return;
+
+    if (isMappedBlock(ptr)) {
+        unmapBlock(ptr);
+        return;
+    }
+
+    size_t size = getUsableSize(ptr);
+    if (size <= CACHE_MAX_SIZE && !isAlignedBlock(ptr)) {
+        ThreadCache *cache = getThreadCache();
+        int cacheClass = (int) (size / ALIGNMENT) - 1;
+
+        if (!cache->registered) {
+            pthread_once(&cacheKeyOnce, createCacheKey);
+            pthread_setspecific(cacheKey, cache);
+            cache->registered = true;
+        }
+
+        *(void **) ptr = cache->objects[cacheClass];
+        cache->objects[cacheClass] = ptr;
+        cache->hits++;
+        if (++cache->count[cacheClass] > CACHE_LIMIT) {
+            flushCacheClass(cache, cacheClass, CACHE_FLUSH);
+        }
+        return;
+    }
+
+    //Blocks always go back to the arena they came from
+    hd = getHeap(ptr);
+    pthread_mutex_lock(&hd->lock);
+    heapFree(ptr);
+    hd->frees++;
+    pthread_mutex_unlock(&hd->lock);
+}
+
+/*
+ * mm_calloc - Allocates zeroed memory for nmemb objects of size bytes. A heap block that
+ *     comes from purged or fresh memory is only cleared where links and footer were, and a
+ *     mapping of its own is zero anyway.
+ */
+void *mm_calloc(size_t nmemb, size_t size) {
+    ThreadCache *cache = getThreadCache();
+    HeapData *hd;
+    void *p;
+
+    //Zero bytes still get a block of their own, as they do from mm_malloc
+    if (size != 0 && nmemb > SIZE_MAX / size) return NULL;
+    size *= nmemb;
+
+    if (mmapThreshold > 0 && size >= mmapThreshold) {
+        p = mapBlock(size);
+        if (p) {
+            hd = getArena(cache->arena);
+            pthread_mutex_lock(&hd->lock);
+            hd->zeroSkipped += size;
+            pthread_mutex_unlock(&hd->lock);
+            return p;
+        }
+    }
+
+    //Cached blocks don't say whether they are zero, so this goes straight to the heap
+    hd = lockArena(cache);
+    p = heapMalloc(hd, size);
+    hd->mallocs++;
+
+    size_t blockSize = 0;
+    if (p && getSlabPage(p) == NULL && getBlock(p)->metaData.isPurged) {
+        blockSize = getSize(&getBlock(p)->metaData);
+        hd->zeroSkipped += size;
+    } else {
+        hd->zeroCleared += size;
+    }
+    pthread_mutex_unlock(&hd->lock);
+
+    if (p == NULL) {
+        p = mm_malloc(size);
+        if (p) memset(p, 0, size);
+    } else if (blockSize > 0) {
+        memset(p, 0, 2 * sizeof(BlockData *));
+        memset((char *) p + blockSize - BLOCK_METADATA_SIZE, 0, BLOCK_METADATA_SIZE);
+    } else {
+        memset(p, 0, size);
+    }
+    return p;
+}
 
+/*
+ * mm_memalign - Allocates size bytes at a multiple of alignment, a power of two. Alignments every
+ *     block has anyway are plain mm_malloc requests. Other aligned blocks always come from the
+ *     heap, a mapping of its own only aligns the payload to MAP_ALIGNMENT bytes.
+ */
+void *mm_memalign(size_t alignment, size_t size) {
+    ThreadCache *cache = getThreadCache();
+    HeapData *hd;
+    void *p;
+
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) return NULL;
+    if (alignment <= minAlignment) return mm_malloc(size);
+
+    hd = lockArena(cache);
+    p = heapMemalign(hd, alignment, size);
+    hd->mallocs++;
+    pthread_mutex_unlock(&hd->lock);
+
+    for (int i = 1; p == NULL && size > 0 && i < numArenas; i++) {
+        hd = getArena((cache->arena + i) % numArenas);
+        pthread_mutex_lock(&hd->lock);
+        p = heapMemalign(hd, alignment, size);
+        pthread_mutex_unlock(&hd->lock);
+    }
+    return p;
+}
+
+//Same as mm_memalign, but alignment must also be a multiple of the pointer size and errors are returned
+int mm_posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment == 0 || alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0) return EINVAL;
+
+    void *p = mm_memalign(alignment, size);
+    if (p == NULL && size > 0) return ENOMEM;
+    *memptr = p;
     return 0;
 }
 
+/*
+ * mm_malloc_batch - Allocates n blocks of size bytes into out and returns how many it got.
+ *     Heap blocks are carved one after the other out of a single free block under one lock.
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **out) {
+    ThreadCache *cache = getThreadCache();
+    HeapData *hd;
+    size_t done = 0;
+
+    if (size == 0) return 0;
+
+    if (mmapThreshold == 0 || size < mmapThreshold) {
+        hd = lockArena(cache);
+        done = heapMallocBatch(hd, size, n, out);
+        hd->mallocs += done;
+        pthread_mutex_unlock(&hd->lock);
+    }
+
+    //Whatever did not fit goes the usual way, which also tries mappings and the other arenas
+    while (done < n && (out[done] = mm_malloc(size)) != NULL) done++;
+    return done;
+}
+
+static int compareAddress(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t) *(void *const *) a;
+    uintptr_t y = (uintptr_t) *(void *const *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * mm_free_batch - Frees n pointers at once. They are sorted by address first, so blocks that
+ *     sit next to each other are joined into one before any free list is touched, and every
+ *     arena is locked only once. The order of ptrs is not kept.
+ */
+void mm_free_batch(void **ptrs, size_t n) {
+    HeapData *locked = NULL;
+
+    qsort(ptrs, n, sizeof(void *), compareAddress);
+
+    for (size_t i = 0; i < n; i++) {
+        void *ptr = ptrs[i];
+
+        if (ptr == NULL) continue;
+        if (isMappedBlock(ptr)) {
+            unmapBlock(ptr);
+            continue;
+        }
+
+        HeapData *hd = getHeap(ptr);
+        if (hd != locked) {
+            if (locked) pthread_mutex_unlock(&locked->lock);
+            pthread_mutex_lock(&hd->lock);
+            locked = hd;
+        }
+        hd->frees++;
+
+        if (getSlabPage(ptr)) {
+            heapFree(ptr);
+            continue;
+        }
+
+        //The blocks right behind ptr that are freed as well become part of its block
+        BlockData *bd = getBlock(ptr);
+        BlockData *last = bd;
+        while (i + 1 < n && ptrs[i + 1] == getPayload(jumpToNext(last))) {
+            last = jumpToNext(last);
+            hd->frees++;
+            i++;
+        }
+
+        if (last == bd) {
+            heapFree(ptr);
+        } else {
+            setSize(&bd->metaData, (char *) jumpToNext(last) - (char *) getPayload(bd));
+            freeBlock(bd);
+        }
+    }
+
+    if (locked) pthread_mutex_unlock(&locked->lock);
+}
+
+void *mm_realloc(void *ptr, size_t size) {
+    HeapData *hd;
+    void *p;
+
+    if (ptr == NULL) return mm_malloc(size);
+
+    //Blocks move between the heap and mappings when they cross the threshold
+    bool toMapping = mmapThreshold > 0 && size >= mmapThreshold;
+    if (isMappedBlock(ptr) && toMapping) return remapBlock(ptr, size);
+    if (isMappedBlock(ptr) || toMapping) {
+        p = toMapping ? mapBlock(size) : NULL;
+        if (p == NULL) p = mm_malloc(size);
+        if (p == NULL) return NULL;
+
+        size_t copySize = getUsableSize(ptr);
+        memcpy(p, ptr, size < copySize ? size : copySize);
+        mm_free(ptr);
+        return p;
+    }
+
+    hd = getHeap(ptr);
+    pthread_mutex_lock(&hd->lock);
+    p = heapRealloc(ptr, size);
+    hd->reallocs++;
+    pthread_mutex_unlock(&hd->lock);
+
+    //The owning arena is full, move the block to any arena that still has room
+    if (p == NULL && size > 0 && numArenas > 1) {
+        p = mm_malloc(size);
+        if (p == NULL) return NULL;
+
+        size_t copySize = getUsableSize(ptr);
+        memcpy(p, ptr, size < copySize ? size : copySize);
+        mm_free(ptr);
+    }
+    return p;
+}
+
+//Slab objects have no header, so the address tells first whether there is one to look at
+bool isMappedBlock(void *ptr) {
+    return !mem_is_heap(ptr) && getBlock(ptr)->metaData.isMapped;
+}
+
+//mm_malloc would hand a cached aligned block out for any request of its size, and mm_memalign never takes one back
+bool isAlignedBlock(void *ptr) {
+    return getSlabPage(ptr) == NULL && getBlock(ptr)->metaData.isAligned;
+}
+
+//The mapping holds a header and the payload, the rest of its last page is usable too
+void *mapBlock(size_t size) {
+    if (size > MAX_REQUEST_SIZE) return NULL;
+    size_t length = (size + MAP_ALIGNMENT + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+
+    char *map = (char *) mem_mmap(length);
+    if (map == (void *) -1) return NULL;
+
+    BlockData *bd = (BlockData *) (map + MAP_ALIGNMENT - BLOCK_METADATA_SIZE);
+    resetBlock(bd);
+    bd->metaData.isUsed = true;
+    bd->metaData.isMapped = true;
+    setSize(&bd->metaData, length - MAP_ALIGNMENT);
+    return getPayload(bd);
+}
+
+//The kernel moves the pages if the mapping can't grow where it is, no copy needed
+void *remapBlock(void *ptr, size_t size) {
+    if (size > MAX_REQUEST_SIZE) return NULL;
+    size_t length = (size + MAP_ALIGNMENT + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+
+    if (length == getSize(&getBlock(ptr)->metaData) + MAP_ALIGNMENT) return ptr;
+
+    char *map = (char *) mem_mremap((char *) ptr - MAP_ALIGNMENT, length);
+    if (map == (void *) -1) return NULL;
+
+    BlockData *bd = (BlockData *) (map + MAP_ALIGNMENT - BLOCK_METADATA_SIZE);
+    setSize(&bd->metaData, length - MAP_ALIGNMENT);
+    return getPayload(bd);
+}
+
+void unmapBlock(void *ptr) {
+    mem_munmap((char *) ptr - MAP_ALIGNMENT);
+}
+
+//Writes the footer. Only free blocks have one
 void *cloneToEnd(BlockData *bd) {
     return memcpy(jumpToEnd(bd), (BlockMetaData*) bd, sizeof(BlockMetaData));
 }
 
-void *mm_malloc(size_t size) {
-    //Align size to byte address
+//The epilogue is a used, empty header at the end of the heap, so every block has a successor
+void writeEpilogue(BlockData *p, bool isPrevFree) {
+    resetBlock(p);
+    p->metaData.isUsed = true;
+    p->metaData.isPrevFree = isPrevFree;
+}
+
+//Caller holds the lock of arena hd
+void *heapMalloc(HeapData *hd, size_t size) {
+    if (size > MAX_REQUEST_SIZE) return NULL;
+    if (minAlignment > ALIGNMENT) return heapMemalign(hd, minAlignment, size > 0 ? size : 1);
+    if (size > 0 && size <= SLAB_MAX_SIZE) {
+        return allocSlabObject(hd, size);
+    }
+
+    //Align size to byte address. Block must be able to hold links and footer once freed
     size = ALIGN(size);
+    if (size < MINIMUM_PAYLOAD_SIZE) size = MINIMUM_PAYLOAD_SIZE;
 
-    //Get heapdata from start of heap
-    void *p = mem_heap_lo();
-    HeapData *hd = (HeapData *) p;
+    //A quick list block of exactly this size is already split and marked used
+    if (size <= QUICK_MAX_SIZE && hd->quickLists[size / ALIGNMENT - 1]) {
+        int quickList = (int) (size / ALIGNMENT) - 1;
+        BlockData *bd = hd->quickLists[quickList];
+
+        hd->quickLists[quickList] = bd->next;
+        hd->quickCount[quickList]--;
+        hd->quickBlocks--;
+        return getPayload(bd);
+    }
 
     //Get block pointer
     void *b;
-    b = findBlock(size);
+    b = findBlock(hd, size);
+    if (b == NULL && hd->quickBlocks > 0) {
+        //Coalescing the deferred blocks may make room
+        flushQuickLists(hd);
+        b = findBlock(hd, size);
+    }
     if (b == NULL) {
-        b = increaseHeap(size);
+        b = increaseHeap(hd, size);
     }
 
     //Cast to BlockData
     if (b == NULL) return NULL;
     BlockData *bd = (BlockData *) b;
 
-    //Mark block as used
+    //Take block off its free list and mark it as used
+    removeFreeBlock(bd);
     bd->metaData.isUsed = true;
 
-    //If block can be split into two, do that
-    BlockData *newBlock = NULL;
-    if (bd->metaData.size >= size + MINIMUM_BLOCK_SIZE) {
-        newBlock = splitBlock(bd, size);
+    //If block can be split into two, do that. The remainder goes back on its list
+    if (getSize(&bd->metaData) >= size + MINIMUM_BLOCK_SIZE) {
+        splitBlock(bd, size);
+    } else {
+        jumpToNext(bd)->metaData.isPrevFree = false;
     }
 
-    //Rewire LL
-    if (bd->next) bd->next->previous = bd->previous;
-    if (bd->previous) bd->previous->next = bd->next;
+    return getPayload(bd);
+}
 
-    //If b was firstFreeBlock in LL, set it to next
-    if (hd->firstFreeBlock == bd) hd->firstFreeBlock = bd->next;
+/*
+ * heapMemalign - Allocates size bytes with a payload aligned to alignment. The leading fragment
+ *     in front of the aligned payload stays behind as a free block of its own, see placeAligned.
+ */
+void *heapMemalign(HeapData *hd, size_t alignment, size_t size) {
+    if (size == 0 || size > MAX_REQUEST_SIZE || alignment > MAX_REQUEST_SIZE) return NULL;
 
-    //Remove refs from block
-    bd->next = NULL;
-    bd->previous = NULL;
+    size = ALIGN(size);
+    if (size < MINIMUM_PAYLOAD_SIZE) size = MINIMUM_PAYLOAD_SIZE;
 
-    //Clone bd data to end
-    cloneToEnd(bd);
+    //Blocks close to the size may happen to have an aligned spot, anything this much larger always does
+    size_t worstCase = size + alignment + MINIMUM_BLOCK_SIZE;
+
+    BlockData *bd = findAlignedBlock(hd, size, alignment);
+    if (bd == NULL) bd = findBlock(hd, worstCase);
+    if (bd == NULL && hd->quickBlocks > 0) {
+        flushQuickLists(hd);
+        bd = findBlock(hd, worstCase);
+    }
+    if (bd == NULL) bd = increaseHeap(hd, worstCase);
+    if (bd == NULL) return NULL;
+
+    bd = placeAligned(bd, size, alignment, 0);
+    if (bd == NULL) return NULL;
+    //Blocks that are only as aligned as every block may go through the thread caches
+    bd->metaData.isAligned = alignment > minAlignment;
+    return getPayload(bd);
+}
+
+/*
+ * heapMallocBatch - Carves up to n blocks of size bytes out of one free block that holds them all,
+ *     and returns how many it got. Only the remainder at the end goes back on a free list.
+ */
+size_t heapMallocBatch(HeapData *hd, size_t size, size_t n, void **out) {
+    size_t done = 0;
+
+    //Slab objects already share a page, and blocks carved back to back are only 8-byte aligned
+    if (size <= SLAB_MAX_SIZE || n < 2 || minAlignment > ALIGNMENT) {
+        while (done < n && (out[done] = heapMalloc(hd, size)) != NULL) done++;
+        return done;
+    }
+    if (size > MAX_REQUEST_SIZE) return 0;
+
+    size = ALIGN(size);
+    if (size < MINIMUM_PAYLOAD_SIZE) size = MINIMUM_PAYLOAD_SIZE;
+
+    //Every block but the first brings its header
+    size_t stride = size + BLOCK_METADATA_SIZE;
+    if (n > SIZE_MAX / stride) return 0;
+    size_t total = n * stride - BLOCK_METADATA_SIZE;
+
+    BlockData *bd = findBlock(hd, total);
+    if (bd == NULL && hd->quickBlocks > 0) {
+        flushQuickLists(hd);
+        bd = findBlock(hd, total);
+    }
+    if (bd == NULL) bd = increaseHeap(hd, total);
+    if (bd == NULL) return 0;
+
+    removeFreeBlock(bd);
+    bSize available = getSize(&bd->metaData);
+
+    BlockData *obj = bd;
+    for (done = 0; done < n; done++) {
+        obj = (BlockData *) ((char *) bd + done * stride);
+        if (done > 0) resetBlock(obj);
+        obj->metaData.isUsed = true;
+        setSize(&obj->metaData, size);
+        out[done] = getPayload(obj);
+    }
 
-    //If split block exists, add to start of LL
-    if (newBlock) {
-        newBlock->next = hd->firstFreeBlock;
-        if (hd->firstFreeBlock) hd->firstFreeBlock->previous = newBlock;
-        hd->firstFreeBlock = newBlock;
+    //The last block takes what is left over and splits it off again if it makes a block
+    setSize(&obj->metaData, size + available - total);
+    if (available - total >= MINIMUM_BLOCK_SIZE) {
+        splitBlock(obj, size);
+    } else {
+        jumpToNext(obj)->metaData.isPrevFree = false;
     }
-    return (void *) (bd + 1);
+
+    return done;
+}
+
+//Sizes are split over two fields so the header stays 8 bytes, the high part is 0 for anything below 4GB
+bSize getSize(BlockMetaData *m) {
+    return ((bSize) m->sizeHigh << 32) | m->sizeLow;
+}
+
+void setSize(BlockMetaData *m, bSize size) {
+    m->sizeLow = (uint32_t) size;
+    m->sizeHigh = (uint32_t) (size >> 32);
 }
 
 void resetBlock(BlockData *p) {
     p->metaData.isUsed = false;
-    p->metaData.other = 0;
-    p->metaData.size = 0;
-    p->next = NULL;
-    p->previous = NULL;
+    p->metaData.isPrevFree = false;
+    p->metaData.isSlab = false;
+    p->metaData.isMapped = false;
+    p->metaData.isPurged = false;
+    p->metaData.isAligned = false;
+    setSize(&p->metaData, 0);
 }
 
-void *increaseHeap(size_t minSize) {
-    bSize newSize = minSize > (2 << 10) ? minSize : (2 << 10);
+/*
+ * growthChunk - Bytes to grow the heap by when missing bytes are needed. Never less than
+ *     GROW_MIN_CHUNK, so the heap does not grow a few bytes at a time.
+ */
+size_t growthChunk(HeapData *hd, size_t missing) {
+    size_t chunk = GROW_MIN_CHUNK;
+
+    switch (hd->growth) {
+        case GROW_GEOMETRIC:
+            chunk = hd->growChunk;
+            if (hd->growChunk < hd->growMax) hd->growChunk *= 2;
+            if (hd->growChunk > hd->growMax) hd->growChunk = hd->growMax;
+            break;
+        case GROW_DEMAND:
+            //Leave room for about one more request like the recent ones
+            hd->growDemand = hd->growDemand ? (3 * hd->growDemand + missing) / 4 : missing;
+            chunk = ALIGN(hd->growDemand);
+            if (chunk > hd->growMax) chunk = hd->growMax;
+            if (chunk < GROW_MIN_CHUNK) chunk = GROW_MIN_CHUNK;
+            break;
+        default:
+            break;
+    }
+
+    return missing > chunk ? missing : chunk;
+}
+
+/*
+ * growArena - mem_region_sbrk for an arena, counting every time it grew. It only ever grows:
+ *     more than INTPTR_MAX bytes would turn into a negative increment and shrink the arena.
+ */
+void *growArena(HeapData *hd, size_t bytes) {
+    if (bytes > INTPTR_MAX) {
+        errno = ENOMEM;
+        return (void *) -1;
+    }
+
+    void *p = mem_region_sbrk(hd->arena, (intptr_t) bytes);
+    if (p != (void *) -1) hd->sbrks++;
+    return p;
+}
+
+/*
+ * increaseHeap - Grows the arena so a block of minSize bytes fits at its end. A free block at the
+ *     end is extended, so only the bytes it is missing are requested.
+ */
+void *increaseHeap(HeapData *hd, size_t minSize) {
+    BlockData *tail = jumpToPrevious(getEpilogue(hd));
+    size_t missing = minSize;
+
+    if (minSize > MAX_REQUEST_SIZE) return NULL;
+
+    //The tail and the new block merge, and the epilogue header in between becomes payload
+    if (tail) missing = getSize(&tail->metaData) + BLOCK_METADATA_SIZE >= minSize
+                        ? MINIMUM_PAYLOAD_SIZE : minSize - getSize(&tail->metaData) - BLOCK_METADATA_SIZE;
+    bSize newSize = growthChunk(hd, ALIGN(missing));
+    //MM_GROW_MAX is not bounded, a chunk near SIZE_MAX must not wrap with the header added
+    if (newSize > SIZE_MAX - BLOCK_METADATA_SIZE) return NULL;
+    bool isZero = (char *) mem_region_zero(hd->arena) <= (char *) mem_region_hi(hd->arena) + 1;
 
-    void *p = mem_sbrk(newSize + BLOCK_METADATA_SIZE);
+    void *p = growArena(hd, newSize + BLOCK_METADATA_SIZE);
     if (p == (void *) -1) return NULL;
-    BlockData *pd = (BlockData *) p;
+
+    //New block starts on the old epilogue, which knows whether the last block is free
+    BlockData *pd = (BlockData *) (((char *) p) - BLOCK_METADATA_SIZE);
+    bool isPrevFree = pd->metaData.isPrevFree;
     resetBlock(pd);
 
-    pd->metaData.size = newSize;
+    //Fresh memory reads as zero just like a purged block, and stays so when merged with a purged tail
+    pd->metaData.isPurged = isZero;
+    pd->metaData.isPrevFree = isPrevFree;
+    setSize(&pd->metaData, newSize);
     cloneToEnd(pd);
+    writeEpilogue(jumpToNext(pd), true);
+    insertFreeBlock(pd);
 
-    return (void *) mergeWithPrev((BlockData *) p);
+    return (void *) mergeWithPrev(pd);
 }
 
 BlockData *mergeWithPrev(BlockData *p) {
     BlockData *prev = jumpToPrevious(p);
     if (prev == NULL) return p;
 
-    if (prev->metaData.isUsed) return p;
+    return mergeBlocks(prev, p);
+}
 
-    unsigned long newSize = prev->metaData.size + p->metaData.size + BLOCK_METADATA_SIZE;
+//Size classes are power-of-two ranges: class 0 holds everything below 1 << MIN_SIZE_CLASS_SHIFT
+int getSizeClass(size_t size) {
+    int sizeClass = 0;
+    size >>= MIN_SIZE_CLASS_SHIFT;
+    while (size > 0 && sizeClass < NUM_SIZE_CLASSES - 1) {
+        size >>= 1;
+        sizeClass++;
+    }
+    return sizeClass;
+}
 
-    prev->metaData.size = newSize;
-    cloneToEnd(prev);
+//Push a free block onto the head of its size class list, or into the tree if it is large
+void insertFreeBlock(BlockData *p) {
+    HeapData *hd = getHeap(p);
+    if (getSize(&p->metaData) >= TREE_MIN_SIZE) {
+        insertTreeBlock(hd, (TreeBlock *) p);
+        return;
+    }
+
+    BlockData **head = &hd->freeLists[getSizeClass(getSize(&p->metaData))];
+
+    p->previous = NULL;
+    p->next = *head;
+    if (*head) (*head)->previous = p;
+    *head = p;
+}
+
+//Unlink a free block from its size class list. Must be called before its size changes
+void removeFreeBlock(BlockData *p) {
+    HeapData *hd = getHeap(p);
+    if (getSize(&p->metaData) >= TREE_MIN_SIZE) {
+        removeTreeBlock(hd, (TreeBlock *) p);
+        return;
+    }
+
+    if (hd->rover == p) hd->rover = p->next;
 
-    //Remove p from LL to confirm merge
-    if (p->next) p->next->previous = p->previous;
     if (p->previous) p->previous->next = p->next;
+    else hd->freeLists[getSizeClass(getSize(&p->metaData))] = p->next;
+    if (p->next) p->next->previous = p->previous;
 
-    return prev;
+    p->next = NULL;
+    p->previous = NULL;
 }
 
 
-void *findBlock(size_t size) {
-    void *p = mem_heap_lo();
-    HeapData *hd = (HeapData *) p;
+//Compares the key (size, addr) with a tree block
+static int compareTreeKey(size_t size, void *addr, TreeBlock *t) {
+    if (size != getSize(&t->metaData)) return size < getSize(&t->metaData) ? -1 : 1;
+    if ((char *) addr != (char *) t) return (char *) addr < (char *) t ? -1 : 1;
+    return 0;
+}
 
-    if (hd->firstFreeBlock == NULL) return NULL;
-    BlockData *curr = hd->firstFreeBlock;
+/*
+ * splayTree - Top-down splay. Brings the block with key (size, addr) to the root,
+ *     or the last block on the search path if there is no such block.
+ */
+TreeBlock *splayTree(TreeBlock *t, size_t size, void *addr) {
+    TreeBlock header;
+    TreeBlock *l, *r, *y;
+
+    if (t == NULL) return t;
+    header.left = header.right = NULL;
+    l = r = &header;
+
+    for (;;) {
+        int cmp = compareTreeKey(size, addr, t);
+        if (cmp < 0) {
+            if (t->left == NULL) break;
+            if (compareTreeKey(size, addr, t->left) < 0) {
+                //Rotate right
+                y = t->left;
+                t->left = y->right;
+                y->right = t;
+                t = y;
+                if (t->left == NULL) break;
+            }
+            //Link right
+            r->left = t;
+            r = t;
+            t = t->left;
+        } else if (cmp > 0) {
+            if (t->right == NULL) break;
+            if (compareTreeKey(size, addr, t->right) > 0) {
+                //Rotate left
+                y = t->right;
+                t->right = y->left;
+                y->left = t;
+                t = y;
+                if (t->right == NULL) break;
+            }
+            //Link left
+            l->right = t;
+            l = t;
+            t = t->right;
+        } else {
+            break;
+        }
+    }
 
-    while (curr->metaData.size < size && curr->next != NULL) {
-        curr = curr->next;
+    //Reassemble
+    l->right = t->left;
+    r->left = t->right;
+    t->left = header.right;
+    t->right = header.left;
+    return t;
+}
+
+void insertTreeBlock(HeapData *hd, TreeBlock *p) {
+    TreeBlock *root = hd->treeRoot;
+
+    p->left = NULL;
+    p->right = NULL;
+    if (root != NULL) {
+        //Split the tree around p, keys are unique because addresses are
+        root = splayTree(root, getSize(&p->metaData), p);
+        if (compareTreeKey(getSize(&p->metaData), p, root) < 0) {
+            p->left = root->left;
+            p->right = root;
+            root->left = NULL;
+        } else {
+            p->right = root->right;
+            p->left = root;
+            root->right = NULL;
+        }
+    }
+    hd->treeRoot = p;
+}
+
+void removeTreeBlock(HeapData *hd, TreeBlock *p) {
+    TreeBlock *root = splayTree(hd->treeRoot, getSize(&p->metaData), p);
+
+    if (root->left == NULL) {
+        root = root->right;
+    } else {
+        //p is larger than everything on its left, so this brings the maximum up with no right child
+        TreeBlock *left = splayTree(root->left, getSize(&p->metaData), p);
+        left->right = root->right;
+        root = left;
     }
+    hd->treeRoot = root;
+}
+
+//Best fit, ties go to the lowest address
+TreeBlock *findTreeBlock(HeapData *hd, size_t size) {
+    if (hd->treeRoot == NULL) return NULL;
+
+    TreeBlock *root = splayTree(hd->treeRoot, size, NULL);
+    hd->treeRoot = root;
+    if (getSize(&root->metaData) >= size) return root;
+
+    //Root is the largest block below the key, so the answer is its successor
+    TreeBlock *curr = root->right;
+    if (curr == NULL) return NULL;
+    while (curr->left != NULL) {
+        curr = curr->left;
+    }
+    return curr;
+}
 
-    if (curr->metaData.size < size) return NULL;
+//In-order successor of a tree block, which becomes the root
+TreeBlock *nextTreeBlock(HeapData *hd, TreeBlock *t) {
+    hd->treeRoot = splayTree(hd->treeRoot, getSize(&t->metaData), t);
+
+    TreeBlock *curr = hd->treeRoot->right;
+    if (curr == NULL) return NULL;
+    while (curr->left != NULL) {
+        curr = curr->left;
+    }
     return curr;
 }
 
+//Smallest of the first ALIGN_CANDIDATES free blocks of at least size bytes that fits an aligned payload
+BlockData *findAlignedBlock(HeapData *hd, size_t size, size_t alignment) {
+    int candidates = 0;
+
+    for (int sizeClass = getSizeClass(size); size < TREE_MIN_SIZE && sizeClass < NUM_SIZE_CLASSES; sizeClass++) {
+        for (BlockData *curr = hd->freeLists[sizeClass]; curr != NULL; curr = curr->next) {
+            if (getSize(&curr->metaData) < size) continue;
+            if (canPlaceAligned(curr, size, alignment, 0)) return curr;
+            if (++candidates >= ALIGN_CANDIDATES) return NULL;
+        }
+    }
+
+    //Tree blocks come in increasing size
+    for (TreeBlock *t = findTreeBlock(hd, size); t != NULL; t = nextTreeBlock(hd, t)) {
+        if (canPlaceAligned((BlockData *) t, size, alignment, 0)) return (BlockData *) t;
+        if (++candidates >= ALIGN_CANDIDATES) return NULL;
+    }
+    return NULL;
+}
+
+//Search one size class list according to the placement policy
+BlockData *searchClass(HeapData *hd, int sizeClass, size_t size) {
+    BlockData *head = hd->freeLists[sizeClass];
+    BlockData *curr;
+    BlockData *best = NULL;
+    int candidates = 0;
+
+    switch (hd->policy) {
+        case NEXT_FIT:
+            //Resume at the rover if it is on this list, wrapping around to the head
+            curr = hd->rover && getSizeClass(getSize(&hd->rover->metaData)) == sizeClass ? hd->rover : head;
+            for (BlockData *start = curr; curr != NULL;) {
+                if (getSize(&curr->metaData) >= size) {
+                    hd->rover = curr;
+                    return curr;
+                }
+                curr = curr->next ? curr->next : head;
+                if (curr == start) break;
+            }
+            return NULL;
+
+        case BEST_FIT:
+        case BOUNDED_BEST_FIT:
+            for (curr = head; curr != NULL; curr = curr->next) {
+                if (getSize(&curr->metaData) < size) continue;
+                if (best == NULL || getSize(&curr->metaData) < getSize(&best->metaData)) best = curr;
+                if (getSize(&best->metaData) == size) break;
+                if (hd->policy == BOUNDED_BEST_FIT && ++candidates >= hd->fitCandidates) break;
+            }
+            return best;
+
+        default:
+            for (curr = head; curr != NULL && getSize(&curr->metaData) < size;) {
+                curr = curr->next;
+            }
+            return curr;
+    }
+}
+
+void *findBlock(HeapData *hd, size_t size) {
+    //Large requests are always best fit from the tree
+    if (size >= TREE_MIN_SIZE) return findTreeBlock(hd, size);
+
+    int sizeClass = getSizeClass(size);
+
+    //Blocks in the starting class may still be too small
+    BlockData *curr = searchClass(hd, sizeClass, size);
+    if (curr) return curr;
+
+    //Every block in a larger class fits and is bigger than anything in a smaller class,
+    //so the policy only has to look at the first non-empty one
+    for (sizeClass++; sizeClass < NUM_SIZE_CLASSES; sizeClass++) {
+        if (hd->freeLists[sizeClass]) return searchClass(hd, sizeClass, size);
+    }
+    return findTreeBlock(hd, size);
+}
+
 void *splitBlock(BlockData *p, size_t size) {
-    if (p->metaData.size < size + BLOCK_METADATA_SIZE) return NULL;
+    if (getSize(&p->metaData) < size + BLOCK_METADATA_SIZE) return NULL;
 
-    bSize sizeBefore = p->metaData.size;
+    bSize sizeBefore = getSize(&p->metaData);
 
     //Set to new size
-    p->metaData.size = size;
+    setSize(&p->metaData, size);
 
     //Extract new block
     BlockData *newBlock = jumpToNext(p);
@@ -173,200 +1196,625 @@ void *splitBlock(BlockData *p, size_t size) {
     //Reset data in new block
     resetBlock(newBlock);
 
-    //Set metadata in new block
-    newBlock->metaData.size = sizeBefore - size - BLOCK_METADATA_SIZE;
+    //Set metadata in new block. Its pages are a part of p's
+    setSize(&newBlock->metaData, sizeBefore - size - BLOCK_METADATA_SIZE);
+    newBlock->metaData.isPurged = p->metaData.isPurged;
     newBlock->metaData.isUsed = false;
+    newBlock->metaData.isPrevFree = !p->metaData.isUsed;
+    jumpToNext(newBlock)->metaData.isPrevFree = true;
 
-    //Clone both to end
-    cloneToEnd(p);
+    //Clone free blocks to end
+    if (!p->metaData.isUsed) cloneToEnd(p);
     cloneToEnd(newBlock);
 
+    //New block is free, so it goes on its size class list
+    insertFreeBlock(newBlock);
+
     return newBlock;
 }
 
-//b1 < b2
+//b1 < b2, both free and on their size class lists
 BlockData *mergeBlocks(BlockData *b1, BlockData *b2) {
-    HeapData *hd = mem_heap_lo();
+    //Size class depends on the size, so unlink both before touching it
+    removeFreeBlock(b1);
+    removeFreeBlock(b2);
 
-    bSize newTotalSize = b1->metaData.size + b2->metaData.size + BLOCK_METADATA_SIZE;
+    //b2's header becomes part of the payload
+    bSize newTotalSize = getSize(&b1->metaData) + getSize(&b2->metaData) + BLOCK_METADATA_SIZE;
 
-    b1->metaData.size = newTotalSize;
+    //Two purged blocks make a purged one once b1's footer and b2's header and links are cleared
+    b1->metaData.isPurged = b1->metaData.isPurged && b2->metaData.isPurged;
+    if (b1->metaData.isPurged) memset(jumpToEnd(b1), 0, BLOCK_METADATA_SIZE + sizeof(BlockData));
 
-    //Remove b1 from the LL
-    if (b1->previous) {
-        b1->previous->next = b1->next;
-    }
-    if (b1->next) {
-        b1->next->previous = b1->previous;
+    setSize(&b1->metaData, newTotalSize);
+
+    cloneToEnd(b1);
+    insertFreeBlock(b1);
+    return b1;
+}
+
+//Caller holds the lock of the arena owning ptr
+void heapFree(void *ptr) {
+    SlabPage *page = getSlabPage(ptr);
+    if (page) {
+        freeSlabObject(getHeap(ptr), page, ptr);
+        return;
     }
 
-    //Remove b2 from LL
-    if (b2->previous) {
-        b2->previous->next = b2->next;
+    BlockData *bd = getBlock(ptr);
+
+    if (!bd->metaData.isUsed) {
+        return;
     }
-    if (b2->next) {
-        b2->next->previous = b2->previous;
+
+    HeapData *hd = getHeap(bd);
+    bSize size = getSize(&bd->metaData);
+    if (hd->deferCoalesce && size <= QUICK_MAX_SIZE) {
+        int quickList = (int) (size / ALIGNMENT) - 1;
+
+        //It has been written to, heapMalloc hands it out as it is
+        bd->metaData.isPurged = false;
+        bd->next = hd->quickLists[quickList];
+        hd->quickLists[quickList] = bd;
+        hd->quickBlocks++;
+        if (++hd->quickCount[quickList] > QUICK_LIMIT) flushQuickLists(hd);
+        return;
     }
 
-    //If b1 or b2 was head, set next to head
-    if (hd->firstFreeBlock == b1 || hd->firstFreeBlock == b2) {
-        hd->firstFreeBlock = b1->next ? b1->next : b2->next;
+    freeBlock(bd);
+}
+
+//Coalesce every block on the quick lists in one go
+void flushQuickLists(HeapData *hd) {
+    for (int i = 0; i < NUM_QUICK_LISTS; i++) {
+        while (hd->quickLists[i]) {
+            BlockData *bd = hd->quickLists[i];
+            hd->quickLists[i] = bd->next;
+            freeBlock(bd);
+        }
+        hd->quickCount[i] = 0;
     }
+    hd->quickBlocks = 0;
+}
 
-    b1->next = NULL;
-    b1->previous = NULL;
-    b2->next = NULL;
-    b2->previous = NULL;
+//Mark a used block free and merge it with its free neighbours
+void freeBlock(BlockData *bd) {
+    bd->metaData.isUsed = false;
+    bd->metaData.isPurged = false;
+    bd->metaData.isAligned = false;
+    cloneToEnd(bd);
+    insertFreeBlock(bd);
 
+    //Check if block before/after can be merged
+    //jumpToPrevious only follows the footer if the header says the previous block is free
+    BlockData *prev = jumpToPrevious(bd);
 
-    cloneToEnd(b1);
-    return b1;
+    //Jump to next is always safe, the epilogue terminates the heap
+    BlockData *next = jumpToNext(bd);
+    if (next->metaData.isUsed) next = NULL;
+
+    if (prev) bd = mergeBlocks(prev, bd);
+    if (next) bd = mergeBlocks(bd, next);
+    next = jumpToNext(bd);
+    next->metaData.isPrevFree = true;
+
+    //Only the epilogue has size 0, so bd is the last block of the arena
+    HeapData *hd = getHeap(bd);
+    if (getSize(&next->metaData) == 0 && hd->trimThreshold > 0 && getSize(&bd->metaData) > hd->trimThreshold) {
+        trimHeap(hd, bd);
+    } else if (hd->purgeThreshold > 0 && hd->purgeDecay == 0) {
+        if (getSize(&bd->metaData) >= hd->purgeThreshold && !bd->metaData.isPurged) purgeBlock(hd, bd);
+    } else if (hd->purgeThreshold > 0 && ++hd->freesSincePurge >= hd->purgeDecay) {
+        purgeArena(hd);
+    }
 }
 
 /*
- * mm_free - Freeing a block does nothing.
+ * purgeArena - Purges every large free block that isn't yet. Running it only every purgeDecay
+ *     frees leaves blocks that are reused right away alone, their pages would just be faulted
+ *     back in.
  */
-void mm_free(void *ptr) {
-    BlockData *bd = (BlockData *) ptr;
-    bd--;
+void purgeArena(HeapData *hd) {
+    BlockData *curr = getFirstBlock(hd);
 
-    if (!bd->metaData.isUsed) {
-        return;
+    for (; getSize(&curr->metaData) != 0; curr = jumpToNext(curr)) {
+        if (!curr->metaData.isUsed && !curr->metaData.isPurged && getSize(&curr->metaData) >= hd->purgeThreshold) {
+            purgeBlock(hd, curr);
+        }
     }
+    hd->freesSincePurge = 0;
+}
 
-    bd->metaData.isUsed = false;
-    void *h = mem_heap_lo();
-    HeapData *hd = (HeapData *) h;
+/*
+ * purgeBlock - Clears a free block between its links and its footer, giving the whole pages in
+ *     there back to the OS. A block keeps isPurged through splits, as the cleared part of each
+ *     half stays untouched, and when merged with another purged block. It loses it when merged
+ *     with anything else or freed after use. On a freshly allocated block it tells that the
+ *     payload past the first two words is zero, up to where the footer was if it was not split.
+ *     increaseHeap sets it as well when memlib hands out memory that was never written to.
+ */
+void purgeBlock(HeapData *hd, BlockData *bd) {
+    char *lo = ((char *) bd) + sizeof(BlockData);
+    char *hi = (char *) jumpToEnd(bd);
+    uintptr_t mask = mem_pagesize() - 1;
+    char *first = (char *) (((uintptr_t) lo + mask) & ~mask);
+    char *last = (char *) ((uintptr_t) hi & ~mask);
+
+    size_t purged = mem_purge(lo, hi);
+    if (purged > 0) {
+        //Only the partial pages at both ends are left to clear by hand
+        memset(lo, 0, first - lo);
+        memset(last, 0, hi - last);
+        hd->purges++;
+        hd->purged += purged;
+    } else if (lo < hi) {
+        memset(lo, 0, hi - lo);
+    }
 
-    //Check if block before/after can be merged
-    void *low = h;
-    char *high = (char *) mem_heap_hi();
+    bd->metaData.isPurged = true;
+    cloneToEnd(bd);
+}
 
-    //jumpToPrevious is not safe to use unless we know for sure that the previous block is inside the scope
-    BlockData *prev = jumpToPrevious(bd);
-    if (prev && (char *) prev >= ((char *) low) + sizeof(HeapData) && !(prev->metaData.isUsed)) {
-        bd = mergeBlocks(prev, bd);
-    }
+//Cut the free block at the end of the arena down to TRIM_PAD and move the epilogue behind it
+void trimHeap(HeapData *hd, BlockData *bd) {
+    size_t release = getSize(&bd->metaData) - TRIM_PAD;
+
+    removeFreeBlock(bd);
+    setSize(&bd->metaData, TRIM_PAD);
+    cloneToEnd(bd);
+    insertFreeBlock(bd);
+    writeEpilogue(jumpToNext(bd), true);
 
+    mem_region_sbrk(hd->arena, -(intptr_t) release);
+    hd->trimmed += release;
+}
 
-    //Jump to next is always safe to use if bd is actual blockdata
+//Grow a used block in place by absorbing a free successor and, for the tail block, moving the epilogue
+bool growBlock(BlockData *bd, size_t size) {
     BlockData *next = jumpToNext(bd);
-    if ((char *) (next + 1) <= high + 1 && !(next->metaData.isUsed)) {
-        bd = mergeBlocks(bd, next);
+    bd->metaData.isPurged = false;
+    size_t available = getSize(&bd->metaData);
+
+    //end is the first block that stays after bd
+    BlockData *end = next;
+    if (!next->metaData.isUsed) {
+        available += BLOCK_METADATA_SIZE + getSize(&next->metaData);
+        end = jumpToNext(next);
     }
 
-    //Then we add bd to the LL
-    if (hd->firstFreeBlock != bd) bd->next = hd->firstFreeBlock;
-    if (hd->firstFreeBlock != NULL) hd->firstFreeBlock->previous = bd;
-    bd->previous = NULL;
-    hd->firstFreeBlock = bd;
-    cloneToEnd(bd);
+    if (available < size) {
+        //Only a block ending at the epilogue can take more memory from the heap
+        if (getSize(&end->metaData) != 0) return false;
+
+        //Grows by a chunk like increaseHeap, the surplus is split off below. Near the end of the region
+        //only the missing bytes may still fit
+        HeapData *hd = getHeap(bd);
+        size_t missing = size - available;
+        size_t grow = growthChunk(hd, missing);
+        if (growArena(hd, grow) == (void *) -1) {
+            if (grow == missing || growArena(hd, missing) == (void *) -1) return false;
+            grow = missing;
+        }
+
+        available += grow;
+        end = (BlockData *) (((char *) end) + grow);
+        writeEpilogue(end, false);
+    }
+
+    if (!next->metaData.isUsed) removeFreeBlock(next);
+
+    setSize(&bd->metaData, available);
+    end->metaData.isPrevFree = false;
+
+    //Give back what we don't need
+    if (available >= size + MINIMUM_BLOCK_SIZE) {
+        splitBlock(bd, size);
+    }
+    return true;
+}
+
+//Shrink a used block in place, merging the cut off tail with a free successor
+void shrinkBlock(BlockData *bd, size_t size) {
+    if (getSize(&bd->metaData) < size + MINIMUM_BLOCK_SIZE) return;
+
+    bd->metaData.isPurged = false;
+    BlockData *tail = splitBlock(bd, size);
+    BlockData *next = jumpToNext(tail);
+    if (!next->metaData.isUsed) {
+        mergeBlocks(tail, next);
+    }
+}
+
+//Where the payload of a block carved from bd starts so that payload % alignment == alignOffset.
+//The leading fragment is either empty or big enough to be a free block of its own
+static uintptr_t alignedPayload(BlockData *bd, size_t alignment, size_t alignOffset) {
+    uintptr_t start = (uintptr_t) bd;
+    uintptr_t payload = ((start + BLOCK_METADATA_SIZE - alignOffset + alignment - 1) & ~((uintptr_t) alignment - 1)) + alignOffset;
+    size_t lead = payload - BLOCK_METADATA_SIZE - start;
+
+    if (lead > 0 && lead < MINIMUM_BLOCK_SIZE) {
+        payload += (MINIMUM_BLOCK_SIZE - lead + alignment - 1) & ~(alignment - 1);
+    }
+    return payload;
+}
+
+bool canPlaceAligned(BlockData *bd, size_t size, size_t alignment, size_t alignOffset) {
+    return alignedPayload(bd, alignment, alignOffset) + size <= (uintptr_t) jumpToNext(bd);
 }
 
 /*
- * mm_realloc - Implemented simply in terms of mm_malloc and mm_free
+ * placeAligned - Allocate size bytes with an aligned payload from the free block bd.
+ *     The misaligned leading fragment stays behind as a free block and the tail is split off.
  */
-void *mm_realloc(void *ptr, size_t size) {
+BlockData *placeAligned(BlockData *bd, size_t size, size_t alignment, size_t alignOffset) {
+    if (!canPlaceAligned(bd, size, alignment, alignOffset)) return NULL;
+
+    char *end = (char *) jumpToNext(bd);
+    BlockData *nb = getBlock((void *) alignedPayload(bd, alignment, alignOffset));
+
+    removeFreeBlock(bd);
+    if (nb != bd) {
+        setSize(&bd->metaData, ((char *) nb) - ((char *) bd) - BLOCK_METADATA_SIZE);
+        cloneToEnd(bd);
+        insertFreeBlock(bd);
+
+        resetBlock(nb);
+        nb->metaData.isPrevFree = true;
+    }
+    nb->metaData.isUsed = true;
+    setSize(&nb->metaData, end - ((char *) nb) - BLOCK_METADATA_SIZE);
+
+    if (getSize(&nb->metaData) >= size + MINIMUM_BLOCK_SIZE) {
+        splitBlock(nb, size);
+    } else {
+        jumpToNext(nb)->metaData.isPrevFree = false;
+    }
+    return nb;
+}
+
+/*
+ * heapRealloc - Shrinks or grows the block in place when possible, otherwise moves it.
+ *     Caller holds the lock of the arena owning ptr, the block never leaves that arena
+ */
+void *heapRealloc(void *ptr, size_t size) {
+    HeapData *hd = getHeap(ptr);
     void *oldptr = ptr;
     void *newptr;
     size_t copySize;
 
-    newptr = mm_malloc(size);
+    //Slab objects can't change size, they only move if they outgrow their class
+    SlabPage *page = getSlabPage(ptr);
+    if (page) {
+        if (size <= page->objectSize) return ptr;
+        newptr = heapMalloc(hd, size);
+        if (newptr == NULL) return NULL;
+        memcpy(newptr, oldptr, page->objectSize);
+        heapFree(oldptr);
+        return newptr;
+    }
+
+    if (size > MAX_REQUEST_SIZE) return NULL;
+
+    BlockData *bd = getBlock(ptr);
+    size_t newSize = ALIGN(size);
+    if (newSize < MINIMUM_PAYLOAD_SIZE) newSize = MINIMUM_PAYLOAD_SIZE;
+
+    if (newSize <= getSize(&bd->metaData)) {
+        shrinkBlock(bd, newSize);
+        return ptr;
+    }
+
+    if (growBlock(bd, newSize)) return ptr;
+
+    newptr = heapMalloc(hd, size);
     if (newptr == NULL)
         return NULL;
 
     //If we realloc to a smaller size, we only copy size bytes
-    copySize = (((BlockData *) ptr) - 1)->metaData.size;
+    copySize = getSize(&bd->metaData);
 
     if (size < copySize)
         copySize = size;
     memcpy(newptr, oldptr, copySize);
-    mm_free(oldptr);
+    heapFree(oldptr);
 
     return newptr;
 }
 
-int validateHeap() {
-    BlockData *start = (BlockData *) (((char *) mem_heap_lo()) + sizeof(HeapData));
-    int nrOfBlocks = 1;
+/*
+ * Slab pages - Used blocks of exactly SLAB_PAGE_SIZE bytes including the header, with the header
+ *     aligned to SLAB_PAGE_SIZE and flagged isSlab. The payload starts with the SlabPage followed by
+ *     objects of one class. Objects have no header: masking an object address gives the block and
+ *     the slab map in HeapData says whether that block is a slab page.
+ */
+static size_t slabPageIndex(HeapData *hd, void *addr) {
+    uintptr_t base = ((uintptr_t) hd) & ~((uintptr_t) SLAB_PAGE_SIZE - 1);
+    return ((((uintptr_t) addr) & ~((uintptr_t) SLAB_PAGE_SIZE - 1)) - base) / SLAB_PAGE_SIZE;
+}
+
+//The map is read without the heap lock, so bits are flipped atomically
+static void setSlabPage(HeapData *hd, SlabPage *page, bool isSlab) {
+    size_t index = slabPageIndex(hd, page);
+    if (isSlab) __atomic_fetch_or(&hd->slabMap[index / 8], (uint8_t) (1 << (index % 8)), __ATOMIC_RELAXED);
+    else __atomic_fetch_and(&hd->slabMap[index / 8], (uint8_t) ~(1 << (index % 8)), __ATOMIC_RELAXED);
+}
 
-    BlockData *prv = start;
-    BlockData *curr = NULL;
+SlabPage *getSlabPage(void *ptr) {
+    HeapData *hd = getHeap(ptr);
+    size_t index = slabPageIndex(hd, ptr);
 
-    while (((void *) (curr = jumpToNext(prv))) < mem_heap_hi()) {
-        if (nrOfBlocks == 340) {
-            printf("Reached");
-        }
-        int diff = (int) (((char *) jumpToNext(curr)) - ((char *) curr));
-        if (curr->metaData.isUsed == false) {
-            printf("Block start: %p \n Block end: %p\n Diff: %d\n Is valid: %b\n Is used: %b \n Size: %u\n Index: %d\n Other stuff: %d \n ----------------------------------------------\n",
+    if (index >= hd->slabMapSize * 8) return NULL;
+    if (!(__atomic_load_n(&hd->slabMap[index / 8], __ATOMIC_RELAXED) & (1 << (index % 8)))) return NULL;
+    return (SlabPage *) getPayload((BlockData *) (((uintptr_t) ptr) & ~((uintptr_t) SLAB_PAGE_SIZE - 1)));
+}
+
+//Aligned page from a free block if one can host it, otherwise carved off the heap tail
+SlabPage *newSlabPage(HeapData *hd, int slabClass) {
+    size_t size = SLAB_PAGE_SIZE - BLOCK_METADATA_SIZE;
+    BlockData *bd = (BlockData *) findTreeBlock(hd, size);
+    if (bd && !canPlaceAligned(bd, size, SLAB_PAGE_SIZE, BLOCK_METADATA_SIZE)) {
+        //Anything this big has an aligned page inside
+        bd = (BlockData *) findTreeBlock(hd, 2 * SLAB_PAGE_SIZE + MINIMUM_BLOCK_SIZE);
+    }
+
+    if (bd) {
+        bd = placeAligned(bd, size, SLAB_PAGE_SIZE, BLOCK_METADATA_SIZE);
+    } else {
+        bd = extendAligned(hd);
+    }
+    if (bd == NULL) return NULL;
+    bd->metaData.isSlab = true;
+
+    SlabPage *page = (SlabPage *) getPayload(bd);
+    page->freeObjects = NULL;
+    page->objectSize = (uint16_t) ((slabClass + 1) * ALIGNMENT);
+    page->usedObjects = 0;
+    page->carvedObjects = 0;
+    //The block may have absorbed a small tail, objects must still stay inside the page
+    page->capacity = (uint16_t) ((size - SLAB_HEADER_SIZE) / page->objectSize);
+    setSlabPage(hd, page, true);
+
+    //Becomes the first page of its class
+    page->previous = NULL;
+    page->next = hd->slabClasses[slabClass];
+    if (page->next) page->next->previous = page;
+    hd->slabClasses[slabClass] = page;
+    return page;
+}
+
+//Carve an aligned page off the heap tail. The padding in front of it becomes a free block
+BlockData *extendAligned(HeapData *hd) {
+    BlockData *start = getEpilogue(hd);
+    uintptr_t pageAddr = (((uintptr_t) start) + SLAB_PAGE_SIZE - 1) & ~((uintptr_t) SLAB_PAGE_SIZE - 1);
+    size_t gap = pageAddr - (uintptr_t) start;
+
+    if (gap > 0 && gap < MINIMUM_BLOCK_SIZE) {
+        pageAddr += SLAB_PAGE_SIZE;
+        gap += SLAB_PAGE_SIZE;
+    }
+    if (slabPageIndex(hd, (void *) pageAddr) >= hd->slabMapSize * 8) return NULL;
+    if (growArena(hd, pageAddr + SLAB_PAGE_SIZE - (uintptr_t) start) == (void *) -1) return NULL;
+
+    bool isPrevFree = start->metaData.isPrevFree;
+    if (gap > 0) {
+        resetBlock(start);
+        start->metaData.isPrevFree = isPrevFree;
+        setSize(&start->metaData, gap - BLOCK_METADATA_SIZE);
+        cloneToEnd(start);
+        insertFreeBlock(start);
+        mergeWithPrev(start);
+        isPrevFree = true;
+    }
+
+    BlockData *bd = (BlockData *) pageAddr;
+    resetBlock(bd);
+    bd->metaData.isUsed = true;
+    bd->metaData.isPrevFree = isPrevFree;
+    setSize(&bd->metaData, SLAB_PAGE_SIZE - BLOCK_METADATA_SIZE);
+    writeEpilogue(jumpToNext(bd), false);
+    return bd;
+}
+
+//Hand an empty page back to the heap as an ordinary block
+void releaseSlabPage(HeapData *hd, SlabPage *page) {
+    int slabClass = page->objectSize / ALIGNMENT - 1;
+
+    if (page->previous) page->previous->next = page->next;
+    else hd->slabClasses[slabClass] = page->next;
+    if (page->next) page->next->previous = page->previous;
+
+    setSlabPage(hd, page, false);
+    getBlock(page)->metaData.isSlab = false;
+    heapFree(page);
+}
+
+void *allocSlabObject(HeapData *hd, size_t size) {
+    int slabClass = (int) ((size + ALIGNMENT - 1) / ALIGNMENT) - 1;
+    SlabPage *page = hd->slabClasses[slabClass];
+    void *obj;
+
+    //Only pages with free objects are on the class list
+    if (page == NULL) page = newSlabPage(hd, slabClass);
+    if (page == NULL) return NULL;
+
+    if (page->freeObjects) {
+        obj = page->freeObjects;
+        page->freeObjects = *(void **) obj;
+    } else {
+        obj = ((char *) page) + SLAB_HEADER_SIZE + page->carvedObjects * page->objectSize;
+        page->carvedObjects++;
+    }
+    page->usedObjects++;
+
+    //Full pages leave the list until an object comes back
+    if (page->usedObjects == page->capacity) {
+        hd->slabClasses[slabClass] = page->next;
+        if (page->next) page->next->previous = NULL;
+        page->next = NULL;
+    }
+    return obj;
+}
+
+void freeSlabObject(HeapData *hd, SlabPage *page, void *ptr) {
+    int slabClass = page->objectSize / ALIGNMENT - 1;
+
+    //A full page is back in business
+    if (page->usedObjects == page->capacity) {
+        page->previous = NULL;
+        page->next = hd->slabClasses[slabClass];
+        if (page->next) page->next->previous = page;
+        hd->slabClasses[slabClass] = page;
+    }
+
+    *(void **) ptr = page->freeObjects;
+    page->freeObjects = ptr;
+    page->usedObjects--;
+
+    //Keep the first page of a class around even when empty, so a single object doesn't thrash it
+    if (page->usedObjects == 0 && hd->slabClasses[slabClass] != page) {
+        releaseSlabPage(hd, page);
+    }
+}
+
+static int validateArenaHeap(HeapData *hd) {
+    BlockData *curr = getFirstBlock(hd);
+    int nrOfBlocks = 0;
+    bool prevFree = false;
+
+    //Walk every block up to the epilogue
+    while (getSize(&curr->metaData) != 0) {
+        size_t diff = ((char *) jumpToNext(curr)) - ((char *) curr);
+        bool isValid = diff == getSize(&curr->metaData) + BLOCK_METADATA_SIZE && !curr->metaData.isMapped
+                       && curr->metaData.isPrevFree == prevFree
+                       && (curr->metaData.isUsed || memcmp(jumpToEnd(curr), &curr->metaData, sizeof(BlockMetaData)) == 0);
+        if (!isValid) {
+            printf("INVALID\n Block start: %p \n Block end: %p\n Diff: %zu\n Is used: %d \n Prev free: %d\n Size: %zu\n Index: %d\n Mapped: %d \n ----------------------------------------------\n",
                    curr,
                    jumpToNext(curr),
                    diff,
-                   diff == curr->metaData.size + BLOCK_METADATA_SIZE && curr->metaData.other == 0,
                    curr->metaData.isUsed,
-                   curr->metaData.size,
+                   curr->metaData.isPrevFree,
+                   (size_t) getSize(&curr->metaData),
                    nrOfBlocks,
-                   curr->metaData.other
+                   curr->metaData.isMapped
             );
+            return -1;
         }
-        if (diff != curr->metaData.size + BLOCK_METADATA_SIZE || curr->metaData.other != 0) {
-            printf("INVALID");
-        }
-        prv = curr;
+        prevFree = !curr->metaData.isUsed;
+        curr = jumpToNext(curr);
         nrOfBlocks++;
     }
 
     return nrOfBlocks;
 }
 
-bool validateLL() {
-    HeapData *hd = (HeapData *) mem_heap_lo();
+//In-order walk of the tree, returns the number of blocks or -1 if it is broken
+static int validateTree(TreeBlock *t, TreeBlock *low, TreeBlock *high) {
+    if (t == NULL) return 0;
+    if (t->metaData.isUsed || getSize(&t->metaData) < TREE_MIN_SIZE) return -1;
+    if (low && compareTreeKey(getSize(&t->metaData), t, low) <= 0) return -1;
+    if (high && compareTreeKey(getSize(&t->metaData), t, high) >= 0) return -1;
+
+    int left = validateTree(t->left, low, t);
+    int right = validateTree(t->right, t, high);
+    if (left < 0 || right < 0) return -1;
+    return left + right + 1;
+}
 
-    BlockData *firstBlock = hd->firstFreeBlock;
+static bool validateArenaLL(HeapData *hd) {
+    char *high = (char *) mem_region_hi(hd->arena);
 
-    BlockData *current = firstBlock;
+    BlockData *firstBlock;
+    BlockData *current;
+    int nrOfFreeBlocks = validateTree(hd->treeRoot, NULL, NULL);
 
-    while (current->next != NULL) {
-        if (current->metaData.isUsed) {
-            return false;
-        }
-        if (current->previous == NULL && current != firstBlock) {
-            return false;
-        }
-        if (current->metaData.other != 0) {
-            return false;
-        }
+    if (nrOfFreeBlocks < 0) {
+        return false;
+    }
 
-        current = current->next;
+    for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+        firstBlock = hd->freeLists[i];
+
+        for (current = firstBlock; current != NULL; current = current->next) {
+            if (current->metaData.isUsed) {
+                return false;
+            }
+            if (current->previous == NULL && current != firstBlock) {
+                return false;
+            }
+            if (current->metaData.isMapped) {
+                return false;
+            }
+            if (getSizeClass(getSize(&current->metaData)) != i || getSize(&current->metaData) >= TREE_MIN_SIZE) {
+                return false;
+            }
+            nrOfFreeBlocks++;
+        }
     }
 
 
     //Check block structure
-    firstBlock = (BlockData *) (hd + 1);
+    firstBlock = getFirstBlock(hd);
     BlockData *prev = NULL;
     current = firstBlock;
 
-    while (current < (BlockData *) mem_heap_hi()) {
+    while ((char *) current < high) {
         if (prev != NULL) {
             if (prev->metaData.isUsed == false && current->metaData.isUsed == false) {
                 return false;
             }
 
-            int distance = (int) (current - prev);
-            int gap = distance - (prev->metaData.size + BLOCK_METADATA_SIZE);
-            if (gap > 0 && (gap < MINIMUM_BLOCK_SIZE || gap % 8 != 1)) {
+            //Header of every block records whether its predecessor is free
+            if (current->metaData.isPrevFree == prev->metaData.isUsed) {
                 return false;
             }
+
+            //Footer of a free block must mirror the header
+            if (!prev->metaData.isUsed && memcmp(jumpToEnd(prev), &prev->metaData, sizeof(BlockMetaData)) != 0) {
+                return false;
+            }
+        }
+
+        if (current->metaData.isMapped) {
+            return false;
         }
 
-        if (current->metaData.other != 0) {
+        //Slab pages are aligned used blocks, and only those are in the slab map
+        if (getSize(&current->metaData) != 0 && (current->metaData.isSlab != (getSlabPage(getPayload(current)) == getPayload(current))
+                                             || (current->metaData.isSlab && !current->metaData.isUsed))) {
             return false;
         }
 
+        //Epilogue has to be the last header in the heap, and every free block must be indexed
+        if (getSize(&current->metaData) == 0) {
+            return current->metaData.isUsed && (char *) jumpToNext(current) == high + 1
+                   && nrOfFreeBlocks == 0;
+        }
+        if (!current->metaData.isUsed) {
+            nrOfFreeBlocks--;
+        }
+
         prev = current;
         current = jumpToNext(current);
     }
+    return false;
+}
+
+int validateHeap() {
+    int nrOfBlocks = 0;
+
+    for (int i = 0; i < numArenas; i++) {
+        int blocks = validateArenaHeap(getArena(i));
+        if (blocks < 0) return -1;
+        nrOfBlocks += blocks;
+    }
+    return nrOfBlocks;
+}
+
+bool validateLL() {
+    for (int i = 0; i < numArenas; i++) {
+        if (!validateArenaLL(getArena(i))) return false;
+    }
     return true;
 }
 
@@ -387,17 +1835,31 @@ int run() {
 }
 
 BlockData *jumpToNext(BlockData *p) {
-    return (BlockData *) (((char *) p) + BLOCK_METADATA_SIZE + p->metaData.size);
+    return (BlockData *) (((char *) p) + BLOCK_METADATA_SIZE + getSize(&p->metaData));
 }
 
+//Only free blocks have a footer, so there is no previous block to jump to unless it is free
 BlockData *jumpToPrevious(BlockData *p) {
-    if (((char *) p - BLOCK_METADATA_SIZE) - sizeof(HeapData) <= (char *) mem_heap_lo()) return NULL;
-    bSize prevSize = (((BlockMetaData *) p) - 1)->size;
+    if (!p->metaData.isPrevFree) return NULL;
+    bSize prevSize = getSize(((BlockMetaData *) p) - 1);
     return (BlockData *) (((char *) p) - BLOCK_METADATA_SIZE - prevSize);
 }
 
+//Footer occupies the last bytes of the payload
 BlockMetaData *jumpToEnd(BlockData *p) {
-    return (BlockMetaData *) (((char *) (p + 1)) + p->metaData.size);
+    return ((BlockMetaData *) jumpToNext(p)) - 1;
+}
+
+BlockData *getEpilogue(HeapData *hd) {
+    return (BlockData *) (((char *) mem_region_hi(hd->arena)) + 1 - BLOCK_METADATA_SIZE);
+}
+
+BlockData *getBlock(void *ptr) {
+    return (BlockData *) (((char *) ptr) - BLOCK_METADATA_SIZE);
+}
+
+void *getPayload(BlockData *p) {
+    return (void *) (((char *) p) + BLOCK_METADATA_SIZE);
 }
 
 
@@ -1,15 +1,23 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <pthread.h>
+#include "config.h"
 
-typedef uint32_t bSize;
+typedef uint64_t bSize;
 
 typedef struct BlockMetaData {
     bool isUsed:1;
-    bSize other:31;
-    bSize size;
+    bool isPrevFree:1;
+    bool isSlab:1;     //Used block whose payload is a slab page
+    bool isMapped:1;   //Used block in a mapping of its own, outside the heap
+    bool isPurged:1;   //The payload past the links reads as zero, see purgeBlock
+    bool isAligned:1;  //Used block from mm_memalign, kept out of the thread caches
+    uint32_t sizeHigh:26; //Size bits 32 and up, read and write sizes through getSize and setSize
+    uint32_t sizeLow;
 } BlockMetaData;
 
+//Header of every block. next and previous overlay the payload and are only valid while the block is free
 typedef struct BlockData {
     BlockMetaData metaData;
     struct BlockData* next;
@@ -17,27 +25,231 @@ typedef struct BlockData {
 } BlockData;
 
 
+//Small free blocks are kept in one LIFO list per power-of-two size class
+#define NUM_SIZE_CLASSES 6
+#define MIN_SIZE_CLASS_SHIFT 5
+//Free blocks from here on go into a splay tree instead, right above the last class
+#define TREE_MIN_SIZE (1 << (MIN_SIZE_CLASS_SHIFT + NUM_SIZE_CLASSES - 1))
+
+//Large free blocks, ordered by (size, address). left and right overlay next and previous
+typedef struct TreeBlock {
+    BlockMetaData metaData;
+    struct TreeBlock* left;
+    struct TreeBlock* right;
+} TreeBlock;
+
+//Requests up to SLAB_MAX_SIZE bytes are served from header-less slab pages, one class per 8 bytes
+#define SLAB_PAGE_SIZE 4096
+#define SLAB_MAX_SIZE 128
+#define NUM_SLAB_CLASSES (SLAB_MAX_SIZE / ALIGNMENT)
+//Bytes of the map with one bit per page a region can span, plus one page because the region start is not page aligned
+#define SLAB_MAP_SIZE(regionSize) (((regionSize) / SLAB_PAGE_SIZE + 1 + 7) / 8)
+
+//A free block at the end of an arena larger than the threshold (MM_TRIM_THRESHOLD, 0 = never)
+//is cut down to TRIM_PAD bytes and the rest is given back to the memory system
+#define TRIM_THRESHOLD (128 << 10)
+#define TRIM_PAD (4 << 10)
+
+//Free blocks in the middle of an arena from PURGE_THRESHOLD bytes on (MM_PURGE_THRESHOLD, 0 = never)
+//give their pages back to the OS, keeping only header, links and footer
+#define PURGE_THRESHOLD (256 << 10)
+//Purging runs every PURGE_DECAY frees (MM_PURGE_DECAY, 0 = as soon as a block is freed)
+#define PURGE_DECAY 4096
+
+//With MM_DEFER_COALESCE=1, freed blocks up to QUICK_MAX_SIZE bytes go onto an exact size quick list
+//and stay marked as used. They are only coalesced when a list grows past QUICK_LIMIT or no free block fits
+#define QUICK_MAX_SIZE 1024
+#define NUM_QUICK_LISTS (QUICK_MAX_SIZE / ALIGNMENT)
+#define QUICK_LIMIT 64
+
+//The heap grows by at least GROW_MIN_CHUNK bytes beyond what a free block at its end already covers.
+//MM_GROWTH picks how large the chunk is: fixed, geometric (doubling up to MM_GROW_MAX) or demand,
+//which follows the recent growth requests
+#define GROW_MIN_CHUNK (2 << 10)
+#define GROW_MAX_CHUNK (64 << 10)
+
+typedef enum GrowthPolicy {
+    GROW_FIXED,
+    GROW_GEOMETRIC,
+    GROW_DEMAND
+} GrowthPolicy;
+
+//Free blocks mm_memalign looks at for an aligned spot before it settles for one that always has one
+#define ALIGN_CANDIDATES 32
+
+//Requests from MMAP_THRESHOLD bytes on (MM_MMAP_THRESHOLD, 0 = never) get a mapping of their own
+#define MMAP_THRESHOLD (256 << 10)
+//The payload of a mapping starts this far into it, as aligned as the C library's malloc
+#define MAP_ALIGNMENT 16
+
+//Payload of a slab page block, followed by the objects
+typedef struct SlabPage {
+    struct SlabPage* next;     //Pages of the same class that have free objects
+    struct SlabPage* previous;
+    void* freeObjects;         //Freed objects, linked through their first word
+    uint16_t objectSize;
+    uint16_t usedObjects;
+    uint16_t carvedObjects;    //Objects past this index have never been handed out
+    uint16_t capacity;
+} SlabPage;
+
+//Placement policy is read from the MM_POLICY environment variable by mm_init
+typedef enum PlacementPolicy {
+    FIRST_FIT,
+    NEXT_FIT,
+    BEST_FIT,
+    BOUNDED_BEST_FIT
+} PlacementPolicy;
+
 typedef struct HeapData {
-    BlockData* firstFreeBlock;
+    BlockData* freeLists[NUM_SIZE_CLASSES];
+    TreeBlock* treeRoot;
+    PlacementPolicy policy;
+    int fitCandidates; //Number of fitting blocks BOUNDED_BEST_FIT looks at
+    BlockData* rover;  //Where NEXT_FIT resumes its search
+    SlabPage* slabClasses[NUM_SLAB_CLASSES];
+    uint8_t *slabMap;               //Which pages of the arena are slab pages
+    size_t slabMapSize;             //The heap size is only known at runtime, and so is the map's
+    pthread_mutex_t lock;           //Guards everything in here and the blocks of the arena
+    int arena;                      //Region of the heap this arena lives in
+    size_t trimThreshold;
+    size_t purgeThreshold;
+    unsigned long purgeDecay;
+    bool deferCoalesce;
+    GrowthPolicy growth;
+    size_t growChunk;               //Next chunk for GROW_GEOMETRIC
+    size_t growMax;
+    size_t growDemand;              //Moving average of the bytes missing on growth, for GROW_DEMAND
+    BlockData* quickLists[NUM_QUICK_LISTS]; //Linked through next
+    int quickCount[NUM_QUICK_LISTS];
+    int quickBlocks;                        //Total over all quick lists
+    unsigned long freesSincePurge;
+    unsigned long mallocs;          //Operations served by this arena
+    unsigned long frees;
+    unsigned long reallocs;
+    unsigned long cacheHits;        //Thread cache operations of threads on this arena
+    unsigned long contended;        //Lock acquisitions that found an arena busy
+    size_t trimmed;                 //Bytes given back at the end of the arena
+    unsigned long purges;           //Free blocks whose pages were given back
+    size_t purged;                  //and how many bytes that was
+    unsigned long sbrks;            //Times the arena grew
+    size_t zeroCleared;             //Bytes mm_calloc had to clear
+    size_t zeroSkipped;             //and bytes it knew were zero already
 } HeapData;
 
+typedef struct ArenaStats {
+    unsigned long mallocs;
+    unsigned long frees;
+    unsigned long reallocs;
+    unsigned long cacheHits;
+    unsigned long contended;
+    size_t trimmed;
+    unsigned long purges;
+    size_t purged;
+    unsigned long sbrks;
+    size_t zeroCleared;
+    size_t zeroSkipped;
+    size_t heapSize;
+} ArenaStats;
+
+//Freed blocks up to CACHE_MAX_SIZE bytes are kept per thread, one stack per 8-byte class
+#define CACHE_MAX_SIZE 256
+#define NUM_CACHE_CLASSES (CACHE_MAX_SIZE / ALIGNMENT)
+#define CACHE_LIMIT 32
+#define CACHE_FLUSH (CACHE_LIMIT / 2)
+
+typedef struct ThreadCache {
+    unsigned long generation;        //Heap the cached blocks belong to
+    bool registered;                 //Flushed on thread exit
+    int arena;                       //Arena this thread allocates from
+    unsigned long hits;              //Not yet added to the arena's cacheHits
+    void* objects[NUM_CACHE_CLASSES];//Linked through their first word
+    int count[NUM_CACHE_CLASSES];
+} ThreadCache;
+
 
 
 extern int mm_init (void);
 extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
+extern void *mm_calloc(size_t nmemb, size_t size);
+extern size_t mm_usable_size(void *ptr);
+extern int mm_try_expand(void *ptr, size_t size);
+extern void *mm_memalign(size_t alignment, size_t size);
+extern int mm_posix_memalign(void **memptr, size_t alignment, size_t size);
+extern int mm_set_alignment(size_t alignment);
+extern size_t mm_malloc_batch(size_t size, size_t n, void **out);
+extern void mm_free_batch(void **ptrs, size_t n);
+extern const char *mm_policy_name(void);
+extern int mm_num_arenas(void);
+extern void mm_arena_stats(int arena, ArenaStats *stats);
+int initArena(int arena);
+HeapData *getArena(int arena);
+BlockData *getFirstBlock(HeapData *hd);
+uint8_t *getSlabMap(int arena, size_t size);
+HeapData *getHeap(void *ptr);
+HeapData *lockArena(ThreadCache *cache);
+void *heapMalloc(HeapData *hd, size_t size);
+void *heapMemalign(HeapData *hd, size_t alignment, size_t size);
+size_t heapMallocBatch(HeapData *hd, size_t size, size_t n, void **out);
+void heapFree(void *ptr);
+void freeBlock(BlockData *bd);
+void flushQuickLists(HeapData *hd);
+void *heapRealloc(void *ptr, size_t size);
+size_t getUsableSize(void *ptr);
+void flushCacheClass(ThreadCache *cache, int cacheClass, int count);
+void readPolicy(HeapData *hd);
+size_t readThreshold(const char *name, size_t fallback);
+void trimHeap(HeapData *hd, BlockData *bd);
+void purgeBlock(HeapData *hd, BlockData *bd);
+void purgeArena(HeapData *hd);
+bool isMappedBlock(void *ptr);
+bool isAlignedBlock(void *ptr);
+void *mapBlock(size_t size);
+void *remapBlock(void *ptr, size_t size);
+void unmapBlock(void *ptr);
+BlockData *searchClass(HeapData *hd, int sizeClass, size_t size);
+TreeBlock *splayTree(TreeBlock *t, size_t size, void *addr);
+void insertTreeBlock(HeapData *hd, TreeBlock *p);
+void removeTreeBlock(HeapData *hd, TreeBlock *p);
+TreeBlock *findTreeBlock(HeapData *hd, size_t size);
+TreeBlock *nextTreeBlock(HeapData *hd, TreeBlock *t);
+BlockData *findAlignedBlock(HeapData *hd, size_t size, size_t alignment);
+SlabPage *getSlabPage(void *ptr);
+SlabPage *newSlabPage(HeapData *hd, int slabClass);
+BlockData *extendAligned(HeapData *hd);
+bool canPlaceAligned(BlockData *bd, size_t size, size_t alignment, size_t alignOffset);
+BlockData *placeAligned(BlockData *bd, size_t size, size_t alignment, size_t alignOffset);
+void releaseSlabPage(HeapData *hd, SlabPage *page);
+void *allocSlabObject(HeapData *hd, size_t size);
+void freeSlabObject(HeapData *hd, SlabPage *page, void *ptr);
 int validateHeap();
 bool validateLL();
+bSize getSize(BlockMetaData *m);
+void setSize(BlockMetaData *m, bSize size);
 void resetBlock(BlockData *p);
 BlockData *mergeWithPrev(BlockData *p);
 void *cloneToEnd(BlockData* bd);
-void *findBlock(size_t size);
+void writeEpilogue(BlockData *p, bool isPrevFree);
+void *findBlock(HeapData *hd, size_t size);
 void *splitBlock(BlockData *p, size_t size);
-void *increaseHeap(size_t minSize);
+void *growArena(HeapData *hd, size_t bytes);
+void *increaseHeap(HeapData *hd, size_t minSize);
+size_t growthChunk(HeapData *hd, size_t missing);
+void readGrowth(HeapData *hd);
+BlockData *mergeBlocks(BlockData *b1, BlockData *b2);
+int getSizeClass(size_t size);
+void insertFreeBlock(BlockData *p);
+void removeFreeBlock(BlockData *p);
 BlockData *findLargestFreeBlock(BlockData*);
 extern void *mm_realloc(void *ptr, size_t size);
+bool growBlock(BlockData *bd, size_t size);
+void shrinkBlock(BlockData *bd, size_t size);
 
 BlockData* jumpToNext(BlockData* p);
 BlockData* jumpToPrevious(BlockData* p) ;
 BlockMetaData* jumpToEnd(BlockData* p);
-BlockData* jumpToFront(BlockData* p);
\ No newline at end of file
+BlockData* jumpToFront(BlockData* p);
+BlockData* getBlock(void *ptr);
+BlockData* getEpilogue(HeapData *hd);
+void* getPayload(BlockData* p);
\ No newline at end of file
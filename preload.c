@@ -0,0 +1,163 @@
+/*
+ * preload.c - Makes the mm package the malloc of a whole process.
+ *
+ * Build libmm.so with "make libmm.so" and run any program with
+ * LD_PRELOAD=./libmm.so to have its malloc, free, realloc, calloc and
+ * the aligned variants served by mm_*. Every block is 16-byte aligned as
+ * programs expect of malloc, although mdriver only asks for 8. The heap
+ * uses the MEM_RESERVE memlib backend, so only the pages in use are
+ * backed by memory. MM_HEAP_MB sets how much address space it reserves,
+ * and all the MM_* variables mdriver lists work here as well.
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "mm.h"
+#include "memlib.h"
+
+//Address space reserved for the heap unless MM_HEAP_MB says otherwise
+#define PRELOAD_HEAP_MB (64 << 10)
+//What programs expect of malloc, alignof(max_align_t) on x86-64. mdriver's 8 bytes would fault on SSE spills
+#define PRELOAD_ALIGNMENT 16
+
+static pthread_once_t heapOnce = PTHREAD_ONCE_INIT;
+static int heapReady = 0;
+
+//Fork with an arena lock or memlib's lock held in another thread would leave it locked in the child
+static void lockArenas(void) {
+    for (int i = 0; i < mm_num_arenas(); i++) pthread_mutex_lock(&getArena(i)->lock);
+    mem_fork_prepare();
+}
+
+static void unlockArenas(void) {
+    for (int i = mm_num_arenas() - 1; i >= 0; i--) pthread_mutex_unlock(&getArena(i)->lock);
+}
+
+static void unlockInParent(void) {
+    mem_fork_parent();
+    unlockArenas();
+}
+
+static void unlockInChild(void) {
+    mem_fork_child();
+    unlockArenas();
+}
+
+static void initHeap(void) {
+    const char *heapMB = getenv("MM_HEAP_MB");
+    size_t size = heapMB ? strtoul(heapMB, NULL, 0) : PRELOAD_HEAP_MB;
+
+    mem_init_size(size << 20);
+    mm_set_alignment(PRELOAD_ALIGNMENT);
+    if (mm_init() < 0) return;
+    pthread_atfork(lockArenas, unlockInParent, unlockInChild);
+    heapReady = 1;
+}
+
+static int ensureHeap(void) {
+    pthread_once(&heapOnce, initHeap);
+    if (!heapReady) errno = ENOMEM;
+    return heapReady;
+}
+
+//Memory from before the heap was set up, for example from the dynamic loader, isn't ours to free
+static int isOwned(void *ptr) {
+    return mem_is_heap(ptr) || mem_is_mapped(ptr, ptr);
+}
+
+//Bytes usable in a block the C library handed out, before our malloc took over
+static size_t foreignSize(void *ptr) {
+    static size_t (*libcUsableSize)(void *) = NULL;
+
+    if (libcUsableSize == NULL) libcUsableSize = (size_t (*)(void *)) dlsym(RTLD_NEXT, "malloc_usable_size");
+    return libcUsableSize != NULL ? libcUsableSize(ptr) : 0;
+}
+
+void *malloc(size_t size) {
+    if (!ensureHeap()) return NULL;
+
+    void *p = mm_malloc(size);
+    if (p == NULL) errno = ENOMEM;
+    return p;
+}
+
+void free(void *ptr) {
+    if (ptr == NULL || !heapReady || !isOwned(ptr)) return;
+    mm_free(ptr);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    if (!ensureHeap()) return NULL;
+
+    void *p = mm_calloc(nmemb, size);
+    if (p == NULL) errno = ENOMEM;
+    return p;
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (!ensureHeap()) return NULL;
+    if (ptr != NULL && !isOwned(ptr)) {
+        //The block moves into the heap, and the old one is dropped as free drops it
+        size_t oldSize = foreignSize(ptr);
+        if (size == 0) return NULL;
+
+        void *p = mm_malloc(size);
+        if (p == NULL) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        memcpy(p, ptr, oldSize < size ? oldSize : size);
+        return p;
+    }
+
+    void *p = mm_realloc(ptr, size);
+    if (p == NULL) errno = ENOMEM;
+    return p;
+}
+
+void *reallocarray(void *ptr, size_t nmemb, size_t size) {
+    if (size != 0 && nmemb > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, nmemb * size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    if (!ensureHeap()) return NULL;
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    void *p = mm_memalign(alignment, size);
+    if (p == NULL) errno = ENOMEM;
+    return p;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (!ensureHeap()) return ENOMEM;
+    return mm_posix_memalign(memptr, alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+void *valloc(size_t size) {
+    return memalign(mem_pagesize(), size);
+}
+
+void *pvalloc(size_t size) {
+    size_t pageSize = mem_pagesize();
+    return memalign(pageSize, (size + pageSize - 1) & ~(pageSize - 1));
+}
+
+size_t malloc_usable_size(void *ptr) {
+    if (ptr == NULL || !heapReady || !isOwned(ptr)) return 0;
+    return mm_usable_size(ptr);
+}
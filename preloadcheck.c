@@ -0,0 +1,94 @@
+/*
+ * preloadcheck.c - Checks what libmm.so promises the programs it runs in.
+ *
+ * "make check" runs it with LD_PRELOAD=./libmm.so. Every block must be
+ * aligned like the C library's, so that SSE spills, long double and
+ * __int128 work in it. Prints what failed and exits with 1 if anything did.
+ */
+#define _GNU_SOURCE
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHECK_ALIGNMENT 16
+
+static int failures = 0;
+
+static void check(int ok, const char *what, size_t size) {
+    if (ok) return;
+    fprintf(stderr, "preloadcheck: %s failed for %lu bytes\n", what, (unsigned long) size);
+    failures++;
+}
+
+static int isAligned(void *p) {
+    return ((uintptr_t) p % CHECK_ALIGNMENT) == 0;
+}
+
+int main(void) {
+    static const size_t sizes[] = {0, 1, 8, 16, 24, 40, 100, 128, 1000, 5000, 300000, 2 << 20};
+    size_t numSizes = sizeof(sizes) / sizeof(sizes[0]);
+    void *blocks[2 * sizeof(sizes) / sizeof(sizes[0])];
+    char *p;
+
+    //Twice each, so the second one doesn't just take the place of the first
+    for (size_t i = 0; i < 2 * numSizes; i++) {
+        size_t size = sizes[i % numSizes];
+        blocks[i] = malloc(size);
+        check(blocks[i] != NULL && isAligned(blocks[i]), "malloc", size);
+    }
+    for (size_t i = 0; i < 2 * numSizes; i += 2) free(blocks[i]);
+
+    for (size_t i = 0; i < numSizes; i++) {
+        size_t size = sizes[i];
+        p = calloc(1, size);
+        check(p != NULL && isAligned(p), "calloc", size);
+        for (size_t j = 0; p != NULL && j < size; j++) {
+            if (p[j] != 0) {
+                check(0, "calloc zeroing", size);
+                break;
+            }
+        }
+        free(p);
+    }
+
+    //An empty calloc still hands out a block of its own
+    void *empty[2] = {calloc(0, 8), calloc(8, 0)};
+    check(empty[0] != NULL && empty[1] != NULL && empty[0] != empty[1], "calloc of nothing", 0);
+    free(empty[0]);
+    free(empty[1]);
+
+    //Blocks move between slab sizes, heap blocks and mappings and back
+    p = NULL;
+    size_t last = 0;
+    for (size_t size = 1; size <= (4 << 20); size = size * 3 / 2 + 1) {
+        p = realloc(p, size);
+        check(p != NULL && isAligned(p), "realloc up", size);
+        if (p) memset(p, 0x5a, size);
+        last = size;
+    }
+    for (size_t size = last; size > 0; size /= 3) {
+        p = realloc(p, size);
+        check(p != NULL && isAligned(p), "realloc down", size);
+        if (p) check(p[size - 1] == 0x5a, "realloc keeping the contents", size);
+    }
+    free(p);
+
+    //Sizes that would wrap around once rounded up or given a header can't be met
+    static const size_t hugeSizes[] = {SIZE_MAX, SIZE_MAX - 4000, SIZE_MAX / 2};
+    for (size_t i = 0; i < sizeof(hugeSizes) / sizeof(hugeSizes[0]); i++) {
+        size_t size = hugeSizes[i];
+        check(malloc(size) == NULL, "malloc refusing", size);
+        check(calloc(1, size) == NULL, "calloc refusing", size);
+        check(memalign(64, size) == NULL, "memalign refusing", size);
+        p = malloc(100);
+        check(p != NULL && realloc(p, size) == NULL, "realloc refusing", size);
+        free(p);
+    }
+
+    for (size_t i = 1; i < 2 * numSizes; i += 2) free(blocks[i]);
+
+    if (failures == 0) printf("preloadcheck: ok\n");
+    return failures > 0;
+}
@@ -0,0 +1,245 @@
+/*
+ * rec2rep.c - Turns an allocation log of librecord.so into a trace.
+ *
+ * "rec2rep mm.1234.rec app.rep" puts the calls of the log back in the
+ * order they were made and numbers the blocks with ids, reusing the id
+ * of a freed block for the next one, so the ids stay below the largest
+ * number of blocks that were live at once. Blocks still live at the end
+ * are freed, so the trace is balanced. Frees of blocks allocated before
+ * recording started are dropped, as are requests over INT_MAX bytes.
+ * mdriver -w turns the result into a binary trace.
+ */
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "record.h"
+
+//A live block of the recorded program, keyed by its address
+typedef struct LiveBlock {
+    uint64_t ptr; //0 for an empty slot
+    int id;
+    int size;
+} LiveBlock;
+
+//Open-addressing table of the live blocks, at most half full
+typedef struct LiveTable {
+    LiveBlock *slots;
+    size_t mask;
+    size_t used;
+} LiveTable;
+
+typedef struct TraceStats {
+    long ops;
+    int numIds;
+    long liveBytes;
+    long peakBytes;
+    long unknownFrees; //Frees of blocks from before recording started
+    long skipped;      //Requests too large for a trace
+    long repaired;     //Addresses handed out again before their free was logged
+} TraceStats;
+
+static LiveTable live;
+static int *freeIds; //Stack of the ids of freed blocks
+static size_t numFreeIds;
+static size_t maxFreeIds;
+static TraceStats stats;
+static FILE *ops;
+
+static void fail(const char *msg) {
+    perror(msg);
+    exit(1);
+}
+
+static size_t hashPtr(uint64_t ptr) {
+    return (size_t) (((ptr >> 4) * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+static void initTable(LiveTable *t, size_t numSlots) {
+    if ((t->slots = calloc(numSlots, sizeof(LiveBlock))) == NULL) fail("calloc");
+    t->mask = numSlots - 1;
+    t->used = 0;
+}
+
+static LiveBlock *findBlock(uint64_t ptr) {
+    for (size_t i = hashPtr(ptr) & live.mask; live.slots[i].ptr != 0; i = (i + 1) & live.mask) {
+        if (live.slots[i].ptr == ptr) return &live.slots[i];
+    }
+    return NULL;
+}
+
+static void insertInto(LiveTable *t, uint64_t ptr, int id, int size) {
+    size_t i = hashPtr(ptr) & t->mask;
+    while (t->slots[i].ptr != 0) i = (i + 1) & t->mask;
+    t->slots[i].ptr = ptr;
+    t->slots[i].id = id;
+    t->slots[i].size = size;
+    t->used++;
+}
+
+static void insertBlock(uint64_t ptr, int id, int size) {
+    if (2 * (live.used + 1) > live.mask + 1) {
+        LiveTable bigger;
+        initTable(&bigger, 2 * (live.mask + 1));
+        for (size_t i = 0; i <= live.mask; i++) {
+            if (live.slots[i].ptr != 0) insertInto(&bigger, live.slots[i].ptr, live.slots[i].id, live.slots[i].size);
+        }
+        free(live.slots);
+        live = bigger;
+    }
+    insertInto(&live, ptr, id, size);
+}
+
+//Blocks after the hole in its probe run move back over it, so no tombstones are needed
+static void removeBlock(LiveBlock *b) {
+    size_t hole = b - live.slots;
+    size_t i = hole;
+
+    while (live.slots[i = (i + 1) & live.mask].ptr != 0) {
+        size_t home = hashPtr(live.slots[i].ptr) & live.mask;
+        if (i > hole ? (home <= hole || home > i) : (home <= hole && home > i)) {
+            live.slots[hole] = live.slots[i];
+            hole = i;
+        }
+    }
+    live.slots[hole].ptr = 0;
+    live.used--;
+}
+
+static int takeId(void) {
+    if (numFreeIds > 0) return freeIds[--numFreeIds];
+
+    //Every id can end up on the stack at once
+    if ((size_t) stats.numIds == maxFreeIds) {
+        maxFreeIds = maxFreeIds ? 2 * maxFreeIds : 1024;
+        if ((freeIds = realloc(freeIds, maxFreeIds * sizeof(int))) == NULL) fail("realloc");
+    }
+    return stats.numIds++;
+}
+
+static void freeBlock(LiveBlock *b) {
+    fprintf(ops, "f %d\n", b->id);
+    stats.ops++;
+    stats.liveBytes -= b->size;
+    freeIds[numFreeIds++] = b->id;
+    removeBlock(b);
+}
+
+//A realloc's block may have been handed out by another thread before the realloc was logged
+static void freeStale(uint64_t ptr) {
+    LiveBlock *stale = findBlock(ptr);
+    if (stale != NULL) {
+        stats.repaired++;
+        freeBlock(stale);
+    }
+}
+
+static void allocBlock(const Record *r, int size) {
+    uint64_t alignment = 8;
+    int id;
+
+    freeStale(r->ptr);
+    id = takeId();
+    switch (r->op) {
+        case REC_CALLOC:
+            fprintf(ops, "c %d %d\n", id, size);
+            break;
+        case REC_MEMALIGN:
+            //The C library rounds the alignment up to a power of two as well
+            while (alignment < r->old) alignment <<= 1;
+            fprintf(ops, "m %d %d %lu\n", id, size, (unsigned long) alignment);
+            break;
+        default:
+            fprintf(ops, "a %d %d\n", id, size);
+    }
+    stats.ops++;
+    stats.liveBytes += size;
+    insertBlock(r->ptr, id, size);
+}
+
+static void reallocBlock(const Record *r, LiveBlock *b, int size) {
+    int id = b->id;
+
+    stats.liveBytes += size - b->size;
+    removeBlock(b);
+    freeStale(r->ptr);
+    fprintf(ops, "r %d %d\n", id, size);
+    stats.ops++;
+    insertBlock(r->ptr, id, size);
+}
+
+static void convert(const Record *r) {
+    LiveBlock *b;
+    //mdriver wants a payload of at least one byte
+    int size = r->size > 0 ? (int) r->size : 1;
+
+    if (r->op == REC_FREE) {
+        if ((b = findBlock(r->ptr)) != NULL) freeBlock(b);
+        else stats.unknownFrees++;
+        return;
+    }
+    if (r->size > INT_MAX) {
+        stats.skipped++;
+        return;
+    }
+
+    //A realloc of a block from before recording started is replayed as a malloc
+    if (r->op == REC_REALLOC && (b = findBlock(r->old)) != NULL) reallocBlock(r, b, size);
+    else allocBlock(r, size);
+    if (stats.liveBytes > stats.peakBytes) stats.peakBytes = stats.liveBytes;
+}
+
+static int bySeq(const void *a, const void *b) {
+    uint64_t x = ((const Record *) a)->seq, y = ((const Record *) b)->seq;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv) {
+    FILE *in, *out;
+    char magic[sizeof(REC_MAGIC)];
+    char chunk[1 << 16];
+    Record *records;
+    size_t numRecords, n;
+    long end;
+
+    if (argc != 3) {
+        fprintf(stderr, "Usage: rec2rep <log> <trace>\n");
+        return 1;
+    }
+    if ((in = fopen(argv[1], "rb")) == NULL) fail(argv[1]);
+    if (fread(magic, sizeof(magic), 1, in) != 1 || memcmp(magic, REC_MAGIC, sizeof(magic)) != 0) {
+        fprintf(stderr, "%s is not an allocation log\n", argv[1]);
+        return 1;
+    }
+    fseek(in, 0, SEEK_END);
+    end = ftell(in);
+    fseek(in, sizeof(magic), SEEK_SET);
+    numRecords = (end - sizeof(magic)) / sizeof(Record);
+    if ((records = malloc(numRecords * sizeof(Record) + 1)) == NULL) fail("malloc");
+    if (fread(records, sizeof(Record), numRecords, in) != numRecords) fail(argv[1]);
+    fclose(in);
+    qsort(records, numRecords, sizeof(Record), bySeq);
+
+    //The header needs the counts, so the requests go to a temporary file first
+    initTable(&live, 1024);
+    if ((ops = tmpfile()) == NULL) fail("tmpfile");
+    for (size_t i = 0; i < numRecords; i++) convert(&records[i]);
+    for (size_t i = 0; i <= live.mask; i++) {
+        while (live.slots[i].ptr != 0) freeBlock(&live.slots[i]);
+    }
+
+    if ((out = fopen(argv[2], "w")) == NULL) fail(argv[2]);
+    fprintf(out, "%ld\n%d\n%ld\n1\n", stats.peakBytes, stats.numIds, stats.ops);
+    rewind(ops);
+    while ((n = fread(chunk, 1, sizeof(chunk), ops)) > 0) {
+        if (fwrite(chunk, 1, n, out) != n) fail(argv[2]);
+    }
+    if (fclose(out) != 0) fail(argv[2]);
+
+    fprintf(stderr, "%s: %lu calls, %ld requests on %d ids, peak %ld bytes live\n", argv[2],
+            (unsigned long) numRecords, stats.ops, stats.numIds, stats.peakBytes);
+    if (stats.unknownFrees + stats.skipped + stats.repaired > 0)
+        fprintf(stderr, "%ld frees of unknown blocks and %ld oversized requests dropped, %ld frees logged late\n",
+                stats.unknownFrees, stats.skipped, stats.repaired);
+    return 0;
+}
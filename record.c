@@ -0,0 +1,215 @@
+/*
+ * record.c - Records the allocations of a whole process.
+ *
+ * Build librecord.so with "make librecord.so" and run any program with
+ * LD_PRELOAD=./librecord.so. Its malloc, calloc, realloc, free and the
+ * memalign family are still served by the C library, but every call is
+ * logged to the file MM_RECORD names, or to mm.<pid>.rec. "rec2rep log
+ * trace" turns the log into a trace mdriver can replay.
+ *
+ * Each thread logs into a buffer of its own and writes it out when it is
+ * full. The only thing threads share per call is the counter that orders
+ * the calls, rec2rep sorts the log by it.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "record.h"
+
+//Records a thread collects before it writes them out
+#define REC_BUFFER 4096
+
+//The C library's allocator, which keeps serving the program
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+typedef struct RecordBuffer {
+    struct RecordBuffer *next; //Every buffer made so far, so the last records can be written at exit
+    int inUse;                 //Owned by a running thread, buffers of finished threads are taken again
+    int count;
+    Record records[REC_BUFFER];
+} RecordBuffer;
+
+static pthread_once_t logOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t bufferKey;
+static int logFd = -1;
+static int stopped = 0;
+static uint64_t nextSeq = 0;
+static RecordBuffer *buffers = NULL;
+
+static __thread RecordBuffer *buffer = NULL;
+static __thread int busy = 0; //Set while the recorder runs, whatever it allocates itself isn't logged
+
+static void writeBuffer(RecordBuffer *b) {
+    char *data = (char *) b->records;
+    size_t left = b->count * sizeof(Record);
+
+    while (left > 0 && logFd >= 0) {
+        ssize_t n = write(logFd, data, left);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        data += n;
+        left -= n;
+    }
+    b->count = 0;
+}
+
+//Thread exit: the buffer goes back to the pool with its records written
+static void releaseBuffer(void *ptr) {
+    RecordBuffer *b = (RecordBuffer *) ptr;
+
+    busy++;
+    writeBuffer(b);
+    buffer = NULL;
+    __atomic_store_n(&b->inUse, 0, __ATOMIC_RELEASE);
+    busy--;
+}
+
+//The copies of the parent's buffers in a forked child are the parent's to write
+static void stopInChild(void) {
+    stopped = 1;
+}
+
+static void openLog(void) {
+    const char *name = getenv("MM_RECORD");
+    char defaultName[64];
+
+    if (name == NULL) {
+        snprintf(defaultName, sizeof(defaultName), "mm.%d.rec", (int) getpid());
+        name = defaultName;
+    }
+    logFd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (logFd < 0 || write(logFd, REC_MAGIC, sizeof(REC_MAGIC)) != sizeof(REC_MAGIC)) {
+        stopped = 1;
+        return;
+    }
+    pthread_key_create(&bufferKey, releaseBuffer);
+    pthread_atfork(NULL, NULL, stopInChild);
+}
+
+//The calling thread's buffer, taken from a finished thread or mapped fresh. NULL once recording stopped
+static RecordBuffer *getBuffer(void) {
+    RecordBuffer *b;
+
+    if (buffer != NULL) return buffer;
+    pthread_once(&logOnce, openLog);
+    if (stopped) return NULL;
+
+    for (b = __atomic_load_n(&buffers, __ATOMIC_ACQUIRE); b != NULL; b = b->next) {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&b->inUse, &expected, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+    }
+    if (b == NULL) {
+        b = mmap(NULL, sizeof(RecordBuffer), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (b == MAP_FAILED) return NULL;
+        b->inUse = 1;
+        b->next = __atomic_load_n(&buffers, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&buffers, &b->next, b, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    pthread_setspecific(bufferKey, b);
+    buffer = b;
+    return b;
+}
+
+static uint64_t takeSeq(void) {
+    return __atomic_fetch_add(&nextSeq, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Allocations take their seq after the call returns and frees before they
+ * are made, so a block freed in one thread and handed out in another is
+ * always freed first in the log
+ */
+static void logCall(uint64_t seq, RecordOp op, void *ptr, uint64_t old, size_t size) {
+    RecordBuffer *b;
+    Record *r;
+
+    busy++;
+    if ((b = getBuffer()) != NULL) {
+        r = &b->records[b->count++];
+        r->seq = seq;
+        r->ptr = (uintptr_t) ptr;
+        r->old = old;
+        r->size = size < UINT32_MAX ? (uint32_t) size : UINT32_MAX;
+        r->op = op;
+        if (b->count == REC_BUFFER) writeBuffer(b);
+    }
+    busy--;
+}
+
+//Writes what every thread still has buffered, threads still running at exit lose what they log later
+__attribute__((destructor)) static void closeLog(void) {
+    if (stopped || logFd < 0) return;
+    busy++;
+    for (RecordBuffer *b = __atomic_load_n(&buffers, __ATOMIC_ACQUIRE); b != NULL; b = b->next) writeBuffer(b);
+    stopped = 1;
+    busy--;
+}
+
+void *malloc(size_t size) {
+    void *p = __libc_malloc(size);
+    if (p != NULL && !busy) logCall(takeSeq(), REC_MALLOC, p, 0, size);
+    return p;
+}
+
+void free(void *ptr) {
+    if (ptr != NULL && !busy) logCall(takeSeq(), REC_FREE, ptr, 0, 0);
+    __libc_free(ptr);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    void *p = __libc_calloc(nmemb, size);
+    if (p != NULL && !busy) logCall(takeSeq(), REC_CALLOC, p, 0, nmemb * size);
+    return p;
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (ptr == NULL) return malloc(size);
+    if (size == 0) {
+        //The C library frees the block and returns NULL
+        free(ptr);
+        return NULL;
+    }
+
+    void *p = __libc_realloc(ptr, size);
+    if (p != NULL && !busy) logCall(takeSeq(), REC_REALLOC, p, (uintptr_t) ptr, size);
+    return p;
+}
+
+void *memalign(size_t alignment, size_t size) {
+    void *p = __libc_memalign(alignment, size);
+    if (p != NULL && !busy) logCall(takeSeq(), REC_MEMALIGN, p, alignment, size);
+    return p;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0) return EINVAL;
+
+    void *p = memalign(alignment, size);
+    if (p == NULL) return ENOMEM;
+    *memptr = p;
+    return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+void *valloc(size_t size) {
+    return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+void *pvalloc(size_t size) {
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    return memalign(pageSize, (size + pageSize - 1) & ~(pageSize - 1));
+}
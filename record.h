@@ -0,0 +1,30 @@
+#ifndef __RECORD_H_
+#define __RECORD_H_
+
+/*
+ * record.h - The allocation log librecord.so writes and rec2rep turns
+ * into a trace. A log is REC_MAGIC followed by Records in the byte
+ * order of the machine that wrote it.
+ */
+#include <stdint.h>
+
+#define REC_MAGIC "MMREC1\n" //8 bytes with the terminating zero
+
+typedef enum RecordOp {
+    REC_MALLOC,
+    REC_CALLOC,
+    REC_REALLOC,
+    REC_FREE,
+    REC_MEMALIGN
+} RecordOp;
+
+//One intercepted call. Threads write their buffers out as they fill, so the log is only ordered by seq
+typedef struct Record {
+    uint64_t seq;  //Position of the call among the calls of all threads
+    uint64_t ptr;  //Block returned, or the one freed
+    uint64_t old;  //Block a realloc was passed, alignment of a memalign
+    uint32_t size; //Bytes asked for, UINT32_MAX for anything larger
+    uint32_t op;   //RecordOp
+} Record;
+
+#endif
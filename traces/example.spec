@@ -0,0 +1,31 @@
+# Workload spec for gentrace, every key it knows with its default.
+# Lines are "key values...", # starts a comment.
+#
+#	unix> ./gentrace traces/example.spec example.rep [seed]
+
+seed 1              # the same spec and seed give the same trace
+ops 100000          # requests in the trace, the final frees included
+live 1000           # most blocks live at once
+max_size 1048576    # sizes are clamped to 1..max_size
+
+# Block sizes, one or more distributions mixed by weight (default 1):
+#   size fixed <n>
+#   size uniform <lo> <hi>
+#   size pow2 <lo> <hi>             powers of two between lo and hi
+#   size lognormal <mu> <sigma>     of the natural log of the size
+#   size bimodal <a> <b> <p>        a with probability p, b otherwise
+size uniform 1 4096
+
+# How many requests a block lives, the same distributions as sizes
+# plus "exponential <mean>". About every other request allocates, so
+# a mean of 2 * live keeps around live blocks live, that's the default.
+# Blocks die earlier when the live set is full.
+lifetime exponential 2000
+
+# Chance a request reallocs a random live block, and the range its size
+# is multiplied by (min and max, max defaults to min)
+realloc 0 1
+
+# Chance an allocation is a calloc, or a memalign to <alignment>
+calloc 0
+memalign 0 64
@@ -0,0 +1,46 @@
+#!/usr/bin/perl
+#!/usr/local/bin/perl
+
+$out_filename = "align-bal.rep";
+@alignments = (16, 64, 4096);
+@blk_sizes = (24, 200, 1000, 4096);
+$num_iters = 2000;
+$live = 64;
+
+# Open output file
+open OUTFILE, ">$out_filename" or die "Cannot create $out_filename\n";
+
+# Every iteration allocates an aligned block and a plain one, and frees the pair
+# allocated $live iterations before
+$num_blocks = 2*$num_iters;
+$num_ops = 4*$num_iters;
+$suggested_heap_size = 2*$live*(4096 + 4096) + 100;
+
+print OUTFILE "$suggested_heap_size\n";
+print OUTFILE "$num_blocks\n";
+print OUTFILE "$num_ops\n";
+print OUTFILE "1\n";
+
+for ($i = 0;  $i < $num_iters; $i += 1) {
+    $seq1 = 2*$i;
+    $seq2 = 2*$i + 1;
+    $align = $alignments[$i % 3];
+    $size1 = $blk_sizes[$i % 4] + ($i % 7)*8;
+    $size2 = $blk_sizes[($i + 1) % 4] - ($i % 5)*4;
+    print OUTFILE "m $seq1 $size1 $align\n";
+    print OUTFILE "a $seq2 $size2\n";
+    if ($i >= $live) {
+        $fseq = 2*($i - $live);
+        print OUTFILE "f $fseq\n";
+        $fseq += 1;
+        print OUTFILE "f $fseq\n";
+    }
+}
+for ($i = $num_iters - $live;  $i < $num_iters; $i += 1) {
+    $fseq = 2*$i;
+    print OUTFILE "f $fseq\n";
+    $fseq += 1;
+    print OUTFILE "f $fseq\n";
+}
+
+close OUTFILE;
@@ -0,0 +1,44 @@
+#!/usr/bin/perl
+#!/usr/local/bin/perl
+
+$out_filename = "batch-bal.rep";
+@blk_sizes = (64, 200, 640);
+$batch_size = 16;
+$num_iters = 600;
+
+# Open output file
+open OUTFILE, ">$out_filename" or die "Cannot create $out_filename\n";
+
+# Every batch is freed two iterations later, every other one block by block
+$num_blocks = $batch_size*$num_iters;
+$num_ops = $num_iters + $num_iters/2 + ($num_iters/2)*$batch_size;
+$suggested_heap_size = 3*$batch_size*$blk_sizes[2] + 100;
+
+print OUTFILE "$suggested_heap_size\n";
+print OUTFILE "$num_blocks\n";
+print OUTFILE "$num_ops\n";
+print OUTFILE "1\n";
+
+sub free_batch {
+    my ($batch) = @_;
+    my $base = $batch*$batch_size;
+    if ($batch % 2) {
+        print OUTFILE "F $base $batch_size\n";
+    } else {
+        for ($j = $batch_size - 1;  $j >= 0; $j -= 1) {
+            $seq = $base + $j;
+            print OUTFILE "f $seq\n";
+        }
+    }
+}
+
+for ($i = 0;  $i < $num_iters; $i += 1) {
+    $base = $i*$batch_size;
+    $size = $blk_sizes[$i % 3];
+    print OUTFILE "A $base $size $batch_size\n";
+    free_batch($i - 2) if ($i >= 2);
+}
+free_batch($num_iters - 2);
+free_batch($num_iters - 1);
+
+close OUTFILE;
@@ -0,0 +1,43 @@
+#!/usr/bin/perl
+#!/usr/local/bin/perl
+
+$out_filename = "calloc-bal.rep";
+$small_size = 100;
+$num_iters = 1000;
+$live = 32;
+
+# Open output file
+open OUTFILE, ">$out_filename" or die "Cannot create $out_filename\n";
+
+# Every iteration callocs a block of 4 to 64 KB and mallocs a small one,
+# and frees the pair allocated $live iterations before
+$num_blocks = 2*$num_iters;
+$num_ops = 4*$num_iters;
+$suggested_heap_size = $live*(65536 + $small_size) + 100;
+
+print OUTFILE "$suggested_heap_size\n";
+print OUTFILE "$num_blocks\n";
+print OUTFILE "$num_ops\n";
+print OUTFILE "1\n";
+
+for ($i = 0;  $i < $num_iters; $i += 1) {
+    $seq1 = 2*$i;
+    $seq2 = 2*$i + 1;
+    $size = 4096*(1 + ($i*7) % 16);
+    print OUTFILE "c $seq1 $size\n";
+    print OUTFILE "a $seq2 $small_size\n";
+    if ($i >= $live) {
+        $fseq = 2*($i - $live);
+        print OUTFILE "f $fseq\n";
+        $fseq += 1;
+        print OUTFILE "f $fseq\n";
+    }
+}
+for ($i = $num_iters - $live;  $i < $num_iters; $i += 1) {
+    $fseq = 2*$i;
+    print OUTFILE "f $fseq\n";
+    $fseq += 1;
+    print OUTFILE "f $fseq\n";
+}
+
+close OUTFILE;
@@ -0,0 +1,12 @@
+# Many small, short-lived blocks with a few long-lived large ones,
+# growing buffers and some aligned allocations.
+seed 2
+ops 200000
+live 4000
+size lognormal 4.5 1.0 weight 8    # mostly around 100 bytes
+size pow2 4096 65536 weight 1
+size bimodal 64 448 0.5 weight 1   # the binary-bal mix
+lifetime lognormal 5 2             # heavy tailed
+realloc 0.05 1.2 2.0
+calloc 0.1
+memalign 0.02 64